@@ -0,0 +1,392 @@
+// select the aruco database to use. Define ARUCO_DB to another database to
+// benchmark the dictionary lookup with it
+#ifndef ARUCO_DB
+#define ARUCO_DB ARUCO_DB_4X4_1000
+#define ARUCO_DB_SIZE 100
+#endif
+
+// select the quad finder to benchmark
+//#define ARUCO_QUAD_FINDER ARUCO_QUAD_HISTOGRAM
+//#define ARUCO_QUAD_FINDER ARUCO_QUAD_POLYGON
+
+// enable the sub-pixel refinement of the sides, sampling the gradient at 4
+// positions per side
+//#define ARUCO_EDGE_REFINE 4
+
+// reweight the side fits robustly, with 2 iterations
+//#define ARUCO_ROBUST_FIT 2
+
+// read each bit from 2x2 grayscale samples instead of one thresholded pixel
+//#define ARUCO_BIT_SAMPLES 2
+
+// undistort the corners (the benchmark lens distortion is set by BENCH_K1)
+//#define ARUCO_UNDISTORT ARUCO_UNDISTORT_CORNERS
+//#define ARUCO_UNDISTORT ARUCO_UNDISTORT_BITS
+
+// accept arucos with up to 2 wrong bits (too many for the 4X4 database, see
+// the README)
+//#define ARUCO_MAX_HAMMING 2
+
+// store only the canonical rotation of each aruco, rotating the codes read
+// instead (a quarter of the flash, for slower lookups)
+//#define ARUCO_COMPACT_DICTIONARY 1
+
+// fill Aruco.quality[] with metrics of each detection
+//#define ARUCO_QUALITY 1
+
+// use fixed point geometry, for targets without a floating point unit
+//#define ARUCO_GEOMETRY ARUCO_GEOMETRY_FIXED
+
+// render the frames on a buffer of the benchmark and process them there,
+// instead of on the ArucoLite object
+//#define ARUCO_EXTERNAL_FRAME 1
+
+// the deadline of process(deadline) is read from a counter of the deadline
+// checks instead of the clock, so that the sequence below stops at the same
+// point on every platform and every run
+uint32_t bench_checks;
+#define ARUCO_MICROS()	(bench_checks++)
+
+// include the ArucoLite header
+#include <ArucoLite.h>
+
+// include the synthetic frame generator
+#include "synthetic_frame.h"
+
+// number of frames to generate per run, arucos per frame (one per quadrant),
+// dark shapes added to the background of each frame, blur passes, noise
+// amplitude, perspective tilt (see synth_make_corners), range of aruco sizes in
+// pixels, radial lens distortion (negative for barrel distortion) and dark
+// bumps on the sides of each aruco (outliers for the side fits, to compare the
+// results with and without ARUCO_ROBUST_FIT)
+#define BENCH_FRAMES	20
+#define BENCH_ARUCOS	4
+#define BENCH_CLUTTER	30
+#ifndef BENCH_BLUR
+#define BENCH_BLUR	1
+#endif
+#ifndef BENCH_NOISE
+#define BENCH_NOISE	6
+#endif
+#ifndef BENCH_TILT
+#define BENCH_TILT	0.3f
+#endif
+#ifndef BENCH_K1
+#define BENCH_K1	0.0f
+#endif
+#ifndef BENCH_SIZE_MIN
+#define BENCH_SIZE_MIN	30
+#define BENCH_SIZE_MAX	110
+#endif
+#ifndef BENCH_BUMPS
+#define BENCH_BUMPS	0
+#endif
+
+// frames of the sequence processed with a deadline, over which the arucos of
+// the last benchmark frame move BENCH_SEQ_STEP pixels per frame, seed of its
+// background, and number of deadline checks cut from each frame (one per
+// candidate at the end of the frame)
+#define BENCH_SEQ_FRAMES	20
+#define BENCH_SEQ_STEP	0.5f
+#define BENCH_SEQ_SEED	777
+#define BENCH_SEQ_CUT	8
+
+// lines fitted in fixed point with edge points near the largest supported
+// coordinates (16384), the number of points of each (the most supported, and a
+// multiple of 5, see below) and their length
+#define BENCH_FIT_LINES	4
+#define BENCH_FIT_POINTS	65535
+#define BENCH_FIT_LENGTH	5000.0f
+
+// the aruco ids are picked from the first 10 of the database for the first
+// quadrant, the next 10 for the second, etc, or less for small databases
+#define BENCH_ID_RANGE	(ARUCO_DB_SIZE / BENCH_ARUCOS < 10 ? ARUCO_DB_SIZE / BENCH_ARUCOS : 10)
+
+// codes used to benchmark the dictionary lookup: half of them are on the
+// database and half are random, like the bits read from candidates that are
+// not arucos
+#define BENCH_LOOKUPS	256
+#define BENCH_LOOKUP_REPEAT	100
+uint64_t lookup_code[BENCH_LOOKUPS];
+
+// declare an ArucoLite object, with the resolution of the HM01B0 camera
+ArucoLite<324, 324, 16, false> Aruco;
+
+// the frames are rendered on Aruco.frame, or on this buffer with
+// ARUCO_EXTERNAL_FRAME, which doesn't have it
+#if ARUCO_EXTERNAL_FRAME
+uint8_t bench_frame[324 * 324];
+#define BENCH_FRAME	bench_frame
+#else
+#define BENCH_FRAME	Aruco.frame[0]
+#endif
+
+// approximate intrinsics of the HM01B0 camera with its standard lens, used to
+// benchmark the pose estimation
+const aruco_camera_t camera = { 300.0f, 300.0f, 162.0f, 162.0f };
+aruco_pose_t pose[16];
+
+// ground truth of the arucos on the current frame
+pt2d_t truth[BENCH_ARUCOS][4];
+int truth_idx[BENCH_ARUCOS];
+
+// generate a cluttered frame with one aruco per quadrant, with random sizes,
+// rotations and perspective distortion
+void generate_frame(void)
+{
+	const int w = Aruco.frame_width, h = Aruco.frame_height;
+	float size;
+
+	synth_clear(BENCH_FRAME, w, h, 160);
+	synth_add_clutter(BENCH_FRAME, w, h, BENCH_CLUTTER, 40);
+	for (int i = 0; i < BENCH_ARUCOS; i++) {
+		size = synth_randf(BENCH_SIZE_MIN, BENCH_SIZE_MAX);
+		synth_make_corners(truth[i],
+			(i & 1) ? w * 0.75f : w * 0.25f,
+			(i & 2) ? h * 0.75f : h * 0.25f,
+			size, synth_randf(0, 6.2832f), size * 0.08f,
+			synth_randf(0, BENCH_TILT));
+		truth_idx[i] = i * BENCH_ID_RANGE + synth_rand(BENCH_ID_RANGE);
+		synth_render_aruco(BENCH_FRAME, w, h, truth[i], truth_idx[i], 30, 220);
+		synth_add_bumps(BENCH_FRAME, w, h, truth[i], BENCH_BUMPS, 30);
+	}
+	for (int i = 0; i < BENCH_BLUR; i++)
+		synth_blur(BENCH_FRAME, w, h);
+	synth_add_noise(BENCH_FRAME, w, h, BENCH_NOISE);
+}
+
+// render frame "step" of the sequence, with the arucos of the last benchmark
+// frame moved to "moved". The background and the noise are the same on every
+// frame, so in incremental mode only the cells around the arucos change
+void sequence_frame(int step, pt2d_t moved[BENCH_ARUCOS][4])
+{
+	const int w = Aruco.frame_width, h = Aruco.frame_height;
+	uint32_t seed = synth_seed;
+
+	synth_seed = BENCH_SEQ_SEED;
+	synth_clear(BENCH_FRAME, w, h, 160);
+	synth_add_clutter(BENCH_FRAME, w, h, BENCH_CLUTTER, 40);
+	for (int i = 0; i < BENCH_ARUCOS; i++) {
+		for (int k = 0; k < 4; k++)
+			moved[i][k] = truth[i][k] + pt2d_t(step * BENCH_SEQ_STEP, step * BENCH_SEQ_STEP * 0.5f);
+		synth_render_aruco(BENCH_FRAME, w, h, moved[i], truth_idx[i], 30, 220);
+	}
+	for (int i = 0; i < BENCH_BLUR; i++)
+		synth_blur(BENCH_FRAME, w, h);
+	synth_add_noise(BENCH_FRAME, w, h, BENCH_NOISE);
+	synth_seed = seed;
+}
+
+void setup(void)
+{
+	// the arucos on the benchmark frames are BENCH_SIZE_MIN to
+	// BENCH_SIZE_MAX pixels wide, plus rotation and perspective. Telling
+	// ArucoLite the expected size range drops the clutter that is out of
+	// range as early as possible
+	Aruco.filter.min_size = BENCH_SIZE_MIN * 5 / 6;
+	Aruco.filter.max_size = BENCH_SIZE_MAX * 3 / 2 + 5;
+
+	// the arucos are rendered with the lens distortion of the camera, and
+	// their ground truth corners are undistorted
+	const aruco_distortion_t lens = { BENCH_K1, 0.0f, 0.0f, 0.0f, 0.0f };
+	synth_lens_k1 = BENCH_K1;
+	synth_lens_f = camera.fx;
+	Aruco.undistort.init(camera, lens);
+
+#if ARUCO_EXTERNAL_FRAME
+	Aruco.set_frame(bench_frame, 324, 324, 324);
+#endif
+}
+
+void loop(void)
+{
+	unsigned long time, total_time = 0, pose_time = 0;
+	int i, j, k, detected = 0, poses = 0, found = 0;
+	float err, total_err = 0, max_err = 0;
+	aruco_rejects_t rejects = {};
+
+	for (int f = 0; f < BENCH_FRAMES; f++) {
+		generate_frame();
+
+		time = micros();
+		Aruco.process();
+		total_time += micros() - time;
+
+		// markers 40mm wide
+		time = micros();
+		Aruco.estimate_poses(camera, 40.0f, pose);
+		pose_time += micros() - time;
+		poses += Aruco.arucos_found;
+
+		rejects.border += Aruco.rejects.border;
+		rejects.size += Aruco.rejects.size;
+		rejects.jump += Aruco.rejects.jump;
+		rejects.fill += Aruco.rejects.fill;
+		rejects.aspect += Aruco.rejects.aspect;
+		rejects.convexity += Aruco.rejects.convexity;
+		rejects.quad += Aruco.rejects.quad;
+		rejects.decode += Aruco.rejects.decode;
+
+		// match the results with the ground truth using the aruco id and
+		// measure the corner position errors
+		for (i = 0; i < Aruco.arucos_found; i++) {
+			for (j = 0; j < BENCH_ARUCOS; j++)
+				if (truth_idx[j] == Aruco.result[i].aruco_idx)
+					break;
+			if (j == BENCH_ARUCOS)
+				continue;
+			detected++;
+			for (k = 0; k < 4; k++) {
+				err = (Aruco.result[i].pt[k] - truth[j][k]).norm();
+				total_err += err;
+				if (err > max_err)
+					max_err = err;
+			}
+		}
+	}
+
+	Serial.print("detected ");
+	Serial.print(detected);
+	Serial.print(" / ");
+	Serial.print(BENCH_FRAMES * BENCH_ARUCOS);
+	Serial.print(" arucos, ");
+	Serial.print(total_time / BENCH_FRAMES);
+	Serial.print(" us per frame, corner error avg ");
+	Serial.print(detected ? total_err / (detected * 4) : 0.0f, 3);
+	Serial.print(" max ");
+	Serial.println(max_err, 3);
+
+	Serial.print("pose estimation: ");
+	Serial.print(pose_time ? (int)(poses * 1000000.0f / pose_time) : 0);
+	Serial.println(" arucos per second");
+
+	// candidates that reach the quad and decode stages are the expensive ones
+	Serial.print("rejected: border ");
+	Serial.print(rejects.border);
+	Serial.print(", size ");
+	Serial.print(rejects.size);
+	Serial.print(", jump ");
+	Serial.print(rejects.jump);
+	Serial.print(", fill ");
+	Serial.print(rejects.fill);
+	Serial.print(", aspect ");
+	Serial.print(rejects.aspect);
+	Serial.print(", convexity ");
+	Serial.print(rejects.convexity);
+	Serial.print(", quad ");
+	Serial.print(rejects.quad);
+	Serial.print(", decode ");
+	Serial.println(rejects.decode);
+
+	// process a sequence where the deadline of each frame skips its last
+	// candidates: it is the number of deadline checks of the first frame,
+	// which is complete, minus BENCH_SEQ_CUT. The candidates near the
+	// arucos of the previous frame are processed first, also in tracking
+	// mode and with undistorted results, so all the arucos should be found.
+	// In incremental mode the windows of the changed cells can need more
+	// checks than the whole first frame, so some may be missed. An aruco is
+	// found if it has the right id and corners, otherwise it is wrong (for
+	// example an id kept by tracking at the wrong place)
+	pt2d_t moved[BENCH_ARUCOS][4];
+	uint32_t start, checks = 0;
+	int seq_found = 0, seq_wrong = 0, seq_complete = 0;
+
+	Aruco.reset_tracking();
+	for (int f = 0; f < BENCH_SEQ_FRAMES; f++) {
+		sequence_frame(f, moved);
+		start = bench_checks;
+		if (f == 0) {
+			Aruco.process(start + 0x40000000);
+			checks = bench_checks - start;
+			continue;
+		}
+		seq_complete += Aruco.process(start + checks - BENCH_SEQ_CUT);
+		for (i = 0; i < Aruco.arucos_found; i++) {
+			for (j = 0; j < BENCH_ARUCOS; j++)
+				if (truth_idx[j] == Aruco.result[i].aruco_idx &&
+				    (Aruco.result[i].pt[0] - moved[j][0]).norm() < 3.0f)
+					break;
+			if (j < BENCH_ARUCOS)
+				seq_found++;
+			else
+				seq_wrong++;
+		}
+	}
+
+	Serial.print("sequence with a deadline: detected ");
+	Serial.print(seq_found);
+	Serial.print(" / ");
+	Serial.print((BENCH_SEQ_FRAMES - 1) * BENCH_ARUCOS);
+	Serial.print(" arucos, ");
+	Serial.print(seq_wrong);
+	Serial.print(" wrong, ");
+	Serial.print(seq_complete);
+	Serial.print(" / ");
+	Serial.print(BENCH_SEQ_FRAMES - 1);
+	Serial.println(" frames complete");
+
+	// fit long lines far from the origin in 16.16 fixed point, whatever the
+	// geometry used by ArucoLite. The points are 0, 0.5 and 1 pixels away
+	// from the line, in turns, so the mean squared distance is 0.5
+	float fit_angle = 0, fit_residual = 0;
+
+	for (i = 0; i < BENCH_FIT_LINES; i++) {
+		line_fit_base_t<fix16_t> fit;
+		line2d_base_t<fix16_t> line;
+		float a = synth_randf(0, 3.1416f), u, off;
+		pt2d_t c(16383 - BENCH_FIT_LENGTH * 0.5f - synth_randf(1, 100),
+			 16383 - BENCH_FIT_LENGTH * 0.5f - synth_randf(1, 100));
+
+		for (k = 0; k < BENCH_FIT_POINTS; k++) {
+			u = (k / (BENCH_FIT_POINTS - 1.0f) - 0.5f) * BENCH_FIT_LENGTH;
+			off = (k % 5 - 2) * 0.5f;
+			fit.add(fix16_t(c.x + cosf(a) * u - sinf(a) * off),
+				fix16_t(c.y + sinf(a) * u + cosf(a) * off));
+		}
+		fit.compute(line);
+		err = fabsf(float(line.v.x) * sinf(a) - float(line.v.y) * cosf(a));
+		if (err > fit_angle)
+			fit_angle = err;
+		err = fabsf(float(fit.residual(line)) - 0.5f);
+		if (err > fit_residual)
+			fit_residual = err;
+	}
+
+	Serial.print("fixed point line fit near 16384: max angle error ");
+	Serial.print(fit_angle, 6);
+	Serial.print(", max residual error ");
+	Serial.println(fit_residual, 6);
+
+	// generate the lookup codes after the frames, so that the frames of the
+	// first run don't depend on the database
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		if (i & 1) {
+			lookup_code[i] = decltype(Aruco)::builtin_dictionary::dictionary.code(synth_rand(ARUCO_DB_SIZE), synth_rand(4));
+		} else {
+			lookup_code[i] = 0;
+			for (j = 0; j < ARUCO_BITS * ARUCO_BITS; j++)
+				lookup_code[i] = (lookup_code[i] << 1) | synth_rand(2);
+		}
+	}
+
+	time = micros();
+	for (k = 0; k < BENCH_LOOKUP_REPEAT; k++)
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			found += decltype(Aruco)::builtin_dictionary::dictionary.find(lookup_code[i]) >= 0;
+	time = micros() - time;
+
+	Serial.print("dictionary lookup: ");
+	Serial.print(time * 1000.0f / (BENCH_LOOKUPS * BENCH_LOOKUP_REPEAT), 1);
+	Serial.print(" ns per code, ");
+	Serial.print(found / BENCH_LOOKUP_REPEAT);
+	Serial.print(" / ");
+	Serial.print(BENCH_LOOKUPS);
+	Serial.print(" found, database size ");
+	Serial.print(ARUCO_DB_SIZE);
+	Serial.print(", tables ");
+	Serial.print(sizeof(decltype(Aruco)::builtin_dictionary::rotations_t) + sizeof(decltype(Aruco)::builtin_dictionary::table_t));
+	Serial.println(" bytes");
+
+	// just sleep for a second to reduce scrolling
+	delay(1000);
+}
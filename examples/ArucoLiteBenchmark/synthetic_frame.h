@@ -0,0 +1,324 @@
+#ifndef SYNTHETIC_FRAME_H
+#define SYNTHETIC_FRAME_H
+
+// helpers to render synthetic arucos with known corner positions into a frame,
+// so that the accuracy of the detected corners can be measured. This needs
+// the ArucoLite header (for the database and pt2d_t) to be included first
+
+// small pseudo random number generator, so that the benchmark produces the
+// same frames on every platform
+static uint32_t synth_seed = 12345;
+
+static int synth_rand(int max)
+{
+	synth_seed = synth_seed * 1103515245 + 12345;
+	return (synth_seed >> 8) % max;
+}
+
+static float synth_randf(float min, float max)
+{
+	return min + (max - min) * synth_rand(10001) / 10000.0f;
+}
+
+// compute the homography that maps the unit square (0,0) (1,0) (1,1) (0,1) to
+// the 4 points in "q"
+static void synth_square_to_quad(const pt2d_t q[4], float h[9])
+{
+	float dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+	float dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+	float sx = q[0].x - q[1].x + q[2].x - q[3].x;
+	float sy = q[0].y - q[1].y + q[2].y - q[3].y;
+	float det = dx1 * dy2 - dx2 * dy1;
+	float g = (sx * dy2 - dx2 * sy) / det;
+	float hh = (dx1 * sy - sx * dy1) / det;
+
+	h[0] = q[1].x - q[0].x + g * q[1].x;
+	h[1] = q[3].x - q[0].x + hh * q[3].x;
+	h[2] = q[0].x;
+	h[3] = q[1].y - q[0].y + g * q[1].y;
+	h[4] = q[3].y - q[0].y + hh * q[3].y;
+	h[5] = q[0].y;
+	h[6] = g;
+	h[7] = hh;
+	h[8] = 1.0f;
+}
+
+static void synth_invert(const float m[9], float r[9])
+{
+	float det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+		    m[1] * (m[3] * m[8] - m[5] * m[6]) +
+		    m[2] * (m[3] * m[7] - m[4] * m[6]);
+
+	r[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+	r[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+	r[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+	r[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+	r[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+	r[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+	r[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+	r[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+	r[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+}
+
+// radial lens distortion applied to the rendered arucos: a point at distance r
+// (in units of synth_lens_f pixels) from the frame center moves to r * (1 + k1 * r^2)
+static float synth_lens_k1 = 0.0f;
+static float synth_lens_f = 300.0f;
+
+// apply (or remove, with "inverse") the lens distortion to the point (x,y) of a
+// width x height frame
+static void synth_lens(float &x, float &y, int width, int height, bool inverse)
+{
+	float nx = (x - width * 0.5f) / synth_lens_f, ny = (y - height * 0.5f) / synth_lens_f;
+	float ux = nx, uy = ny, r;
+
+	if (synth_lens_k1 == 0.0f)
+		return;
+
+	if (inverse) {
+		for (int i = 0; i < 10; i++) {
+			r = 1 + synth_lens_k1 * (ux * ux + uy * uy);
+			ux = nx / r;
+			uy = ny / r;
+		}
+	} else {
+		r = 1 + synth_lens_k1 * (nx * nx + ny * ny);
+		ux = nx * r;
+		uy = ny * r;
+	}
+	x = ux * synth_lens_f + width * 0.5f;
+	y = uy * synth_lens_f + height * 0.5f;
+}
+
+// return the color of the aruco at the (u,v) position of the unit square, or
+// -1 if the position is outside the aruco
+static int synth_aruco_color(int aruco_idx, float u, float v)
+{
+	const int total_bits = ARUCO_BITS + 2;
+	int col, row, bit;
+
+	if (u < 0.0f || u >= 1.0f || v < 0.0f || v >= 1.0f)
+		return -1;
+
+	col = u * total_bits;
+	row = v * total_bits;
+	if (col == 0 || row == 0 || col == total_bits - 1 || row == total_bits - 1)
+		return 0;
+
+	// the top left cell is on the most significant bit
+	bit = (row - 1) * ARUCO_BITS + col - 1;
+	return (database_codes[aruco_idx] >> (ARUCO_BITS * ARUCO_BITS - 1 - bit)) & 1;
+}
+
+// render aruco "aruco_idx" with its corners at "pt" (clockwise, starting at
+// the top left corner of the aruco, before lens distortion), surrounded by a
+// white quiet zone of 1/4 of the aruco size. Each pixel is super sampled 4x4 to
+// produce anti-aliased edges
+static void synth_render_aruco(uint8_t *frame, int width, int height, const pt2d_t pt[4],
+			       int aruco_idx, int black, int white)
+{
+	static const float zone[4][2] = { { -0.25f, -0.25f }, { 1.25f, -0.25f }, { 1.25f, 1.25f }, { -0.25f, 1.25f } };
+	float h[9], inv[9], fx, fy, u, v, w;
+	int x, y, sx, sy, c, sum, x1, x2, y1, y2, i;
+
+	synth_square_to_quad(pt, h);
+	synth_invert(h, inv);
+
+	// bounding box of the quiet zone
+	x1 = width;
+	y1 = height;
+	x2 = 0;
+	y2 = 0;
+	for (i = 0; i < 4; i++) {
+		w = h[6] * zone[i][0] + h[7] * zone[i][1] + h[8];
+		fx = (h[0] * zone[i][0] + h[1] * zone[i][1] + h[2]) / w;
+		fy = (h[3] * zone[i][0] + h[4] * zone[i][1] + h[5]) / w;
+		synth_lens(fx, fy, width, height, false);
+		if (fx < x1) x1 = fx;
+		if (fy < y1) y1 = fy;
+		if (fx + 1 > x2) x2 = fx + 1;
+		if (fy + 1 > y2) y2 = fy + 1;
+	}
+	// the distorted sides are curved, leave some margin
+	if (synth_lens_k1 != 0.0f) {
+		i = (x2 - x1) / 8 + 2;
+		x1 -= i;
+		y1 -= i;
+		x2 += i;
+		y2 += i;
+	}
+	if (x1 < 0) x1 = 0;
+	if (y1 < 0) y1 = 0;
+	if (x2 > width) x2 = width;
+	if (y2 > height) y2 = height;
+
+	for (y = y1; y < y2; y++) {
+		for (x = x1; x < x2; x++) {
+			sum = 0;
+			for (sy = 0; sy < 4; sy++) {
+				for (sx = 0; sx < 4; sx++) {
+					fx = x + (sx + 0.5f) / 4;
+					fy = y + (sy + 0.5f) / 4;
+					synth_lens(fx, fy, width, height, true);
+					w = inv[6] * fx + inv[7] * fy + inv[8];
+					u = (inv[0] * fx + inv[1] * fy + inv[2]) / w;
+					v = (inv[3] * fx + inv[4] * fy + inv[5]) / w;
+					c = synth_aruco_color(aruco_idx, u, v);
+					if (c < 0 && (u < -0.25f || u >= 1.25f || v < -0.25f || v >= 1.25f))
+						sum += frame[y * width + x];
+					else
+						sum += c > 0 || c < 0 ? white : black;
+				}
+			}
+			frame[y * width + x] = sum / 16;
+		}
+	}
+}
+
+// draw a line from (x1,y1) to (x2,y2) with the given thickness
+static void synth_draw_line(uint8_t *frame, int width, int height, float x1, float y1,
+			    float x2, float y2, float thickness, int color)
+{
+	float dx = x2 - x1, dy = y2 - y1, len2 = dx * dx + dy * dy, t, px, py, r2;
+	int x, y, bx1, by1, bx2, by2;
+
+	r2 = thickness * thickness * 0.25f;
+	bx1 = (x1 < x2 ? x1 : x2) - thickness;
+	by1 = (y1 < y2 ? y1 : y2) - thickness;
+	bx2 = (x1 > x2 ? x1 : x2) + thickness;
+	by2 = (y1 > y2 ? y1 : y2) + thickness;
+	if (bx1 < 0) bx1 = 0;
+	if (by1 < 0) by1 = 0;
+	if (bx2 > width) bx2 = width;
+	if (by2 > height) by2 = height;
+
+	for (y = by1; y < by2; y++) {
+		for (x = bx1; x < bx2; x++) {
+			t = len2 > 0 ? ((x + 0.5f - x1) * dx + (y + 0.5f - y1) * dy) / len2 : 0;
+			if (t < 0) t = 0;
+			if (t > 1) t = 1;
+			px = x1 + t * dx - (x + 0.5f);
+			py = y1 + t * dy - (y + 0.5f);
+			if (px * px + py * py <= r2)
+				frame[y * width + x] = color;
+		}
+	}
+}
+
+// add "count" random dark shapes that are not arucos (lines, L shapes and
+// filled blocks) to the frame, to simulate a cluttered scene
+static void synth_add_clutter(uint8_t *frame, int width, int height, int count, int color)
+{
+	float x, y, a, len, th;
+
+	for (int i = 0; i < count; i++) {
+		x = synth_randf(0, width);
+		y = synth_randf(0, height);
+		a = synth_randf(0, 6.2832f);
+		len = synth_randf(10, 120);
+		th = synth_randf(2, 10);
+		switch (synth_rand(3)) {
+		case 0:
+			synth_draw_line(frame, width, height, x, y, x + cosf(a) * len, y + sinf(a) * len, th, color);
+			break;
+		case 1:
+			synth_draw_line(frame, width, height, x, y, x + cosf(a) * len, y + sinf(a) * len, th, color);
+			synth_draw_line(frame, width, height, x, y, x - sinf(a) * len, y + cosf(a) * len, th, color);
+			break;
+		default:
+			synth_draw_line(frame, width, height, x, y, x + cosf(a) * len * 0.3f, y + sinf(a) * len * 0.3f, len * 0.3f, color);
+			break;
+		}
+	}
+}
+
+// add "count" dark bumps of "color" on the sides of the aruco with corners
+// "pt", like objects that touch or partly hide it. Each one sticks out of the
+// middle of a side, so the contour goes around it and its edge points are
+// outliers for the fit of the side
+static void synth_add_bumps(uint8_t *frame, int width, int height, const pt2d_t pt[4], int count, int color)
+{
+	pt2d_t center = (pt[0] + pt[1] + pt[2] + pt[3]) * 0.25f, p, n;
+	float size, len, th;
+	int e;
+
+	for (int i = 0; i < count; i++) {
+		e = synth_rand(4);
+		p = pt[e] + (pt[(e + 1) & 3] - pt[e]) * synth_randf(0.25f, 0.75f);
+		size = (pt[(e + 1) & 3] - pt[e]).norm();
+		n = pt2d_t(pt[(e + 1) & 3].y - pt[e].y, pt[e].x - pt[(e + 1) & 3].x) * (1.0f / size);
+		if (n.x * (p.x - center.x) + n.y * (p.y - center.y) < 0)
+			n = -n;
+		len = size * synth_randf(0.03f, 0.06f);
+		th = size * synth_randf(0.03f, 0.06f);
+		synth_draw_line(frame, width, height, p.x, p.y, p.x + n.x * len, p.y + n.y * len, th, color);
+	}
+}
+
+// fill the frame with a uniform background
+static void synth_clear(uint8_t *frame, int width, int height, int bg)
+{
+	for (int i = 0; i < width * height; i++)
+		frame[i] = bg;
+}
+
+// add uniform noise in the [-noise, noise] range to every pixel
+static void synth_add_noise(uint8_t *frame, int width, int height, int noise)
+{
+	int v;
+
+	if (noise == 0)
+		return;
+	for (int i = 0; i < width * height; i++) {
+		v = frame[i] + synth_rand(noise * 2 + 1) - noise;
+		frame[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+	}
+}
+
+// apply a 3x3 box blur to the frame, to simulate the camera optics. The
+// border pixels are left unchanged
+static void synth_blur(uint8_t *frame, int width, int height)
+{
+	static uint8_t prev[2][1024];
+	int x, y, sum;
+	uint8_t *row;
+
+	if (width > 1024)
+		return;
+
+	// keep a copy of the original previous and current lines, as the
+	// frame is blurred in place
+	memcpy(prev[0], frame, width);
+	for (y = 1; y < height - 1; y++) {
+		row = &frame[y * width];
+		memcpy(prev[y & 1], row, width);
+		for (x = 1; x < width - 1; x++) {
+			sum = prev[(y - 1) & 1][x - 1] + prev[(y - 1) & 1][x] + prev[(y - 1) & 1][x + 1] +
+			      prev[y & 1][x - 1] + prev[y & 1][x] + prev[y & 1][x + 1] +
+			      row[width + x - 1] + row[width + x] + row[width + x + 1];
+			row[x] = sum / 9;
+		}
+	}
+}
+
+// generate the 4 corners of an aruco centered on (cx,cy), with side "size",
+// rotated by "angle" radians and with each corner randomly displaced by up to
+// "jitter" pixels, to simulate perspective. "tilt" (0 to 1) adds a stronger
+// perspective, making one side shorter than the opposite one by that fraction
+static void synth_make_corners(pt2d_t pt[4], float cx, float cy, float size, float angle, float jitter, float tilt)
+{
+	static const float sq[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+	float c = cosf(angle) * size * 0.5f, s = sinf(angle) * size * 0.5f;
+	float sx, sy;
+
+	for (int i = 0; i < 4; i++) {
+		// the tilt makes the top side shorter than the bottom one, like
+		// a square seen from below
+		sx = sq[i][0] * (1.0f + sq[i][1] * tilt);
+		sy = sq[i][1];
+		pt[i].x = cx + sx * c - sy * s + synth_randf(-jitter, jitter);
+		pt[i].y = cy + sx * s + sy * c + synth_randf(-jitter, jitter);
+	}
+}
+
+#endif
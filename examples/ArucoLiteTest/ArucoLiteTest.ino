@@ -2,6 +2,10 @@
 #define ARUCO_DB ARUCO_DB_4X4_1000
 #define ARUCO_DB_SIZE 100
 
+// process the test frame where it is, instead of copying it to the ArucoLite
+// object, which then doesn't need the memory for a frame
+//#define ARUCO_EXTERNAL_FRAME 1
+
 // include the ArucoLite header
 #include <ArucoLite.h>
 
@@ -19,8 +23,14 @@ void loop(void)
 {
   // copy the test frame to the ArucoLite object frame. On a real application
   // with a camera, ideally the camera would be setup to DMA the image data
-  // directly into the frame, thus avoiding the memcpy completely
+  // directly into the frame, thus avoiding the memcpy completely. With
+  // ARUCO_EXTERNAL_FRAME, the frame is processed where it is instead, and
+  // its rows can be any number of bytes apart (324 here)
+#if ARUCO_EXTERNAL_FRAME
+  Aruco.set_frame(test_frame, 324, 324, 324);
+#else
   memcpy(Aruco.frame[0], test_frame, sizeof(test_frame));
+#endif
 
   // call process and measure the processing time
   unsigned long time = micros();
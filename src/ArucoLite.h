@@ -2,6 +2,7 @@
 #define ARUCOLITE_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
@@ -13,8 +14,163 @@
 #endif
 
 #include "database.h"
+#include "dictionary.h"
+
+// select the method used to find the 4 sides of a candidate aruco:
+// - ARUCO_QUAD_HISTOGRAM groups the edge points by direction and fits lines to
+//   the 4 dominant directions. It is the most tolerant to noise and blur
+// - ARUCO_QUAD_POLYGON finds the corners directly on the contour and fits lines
+//   to the interior of each side. It is faster, but works best with clean, high
+//   contrast images
+#define ARUCO_QUAD_HISTOGRAM	1
+#define ARUCO_QUAD_POLYGON	2
+
+#ifndef ARUCO_QUAD_FINDER
+#define ARUCO_QUAD_FINDER	ARUCO_QUAD_HISTOGRAM
+#endif
+
+// number of positions per side where the grayscale gradient is sampled to
+// refine the sides of the aruco with sub-pixel accuracy after the initial fit.
+// The default of 0 disables the refinement
+#ifndef ARUCO_EDGE_REFINE
+#define ARUCO_EDGE_REFINE	0
+#endif
+
+// number of robust (iteratively reweighted, Huber) iterations done after the
+// least squares fit of each side, to reduce the influence of points from the
+// corners and noise. The default of 0 disables the robust fitting
+#ifndef ARUCO_ROBUST_FIT
+#define ARUCO_ROBUST_FIT	0
+#endif
+
+// number of grayscale samples per cell side used to read each bit. With the
+// default of 0, each bit is read from a single pixel of the thresholded image.
+// With N > 0, N x N samples are averaged over the center of each cell and
+// compared to a threshold computed from the aruco's own border and interior,
+// which reads small and blurry arucos more reliably
+#ifndef ARUCO_BIT_SAMPLES
+#define ARUCO_BIT_SAMPLES	0
+#endif
+
+// select the lens distortion correction, done with a precomputed grid (see
+// undistort.h) that must be initialized with the camera calibration:
+// - ARUCO_UNDISTORT_NONE: no correction, the corners are in frame coordinates
+// - ARUCO_UNDISTORT_CORNERS: only the final corners are undistorted
+// - ARUCO_UNDISTORT_BITS: the corners are undistorted before reading the bits,
+//   and the bit positions are distorted back to sample the frame, which reads
+//   arucos bent by strong distortion correctly
+#define ARUCO_UNDISTORT_NONE	0
+#define ARUCO_UNDISTORT_CORNERS	1
+#define ARUCO_UNDISTORT_BITS	2
+
+#ifndef ARUCO_UNDISTORT
+#define ARUCO_UNDISTORT		ARUCO_UNDISTORT_NONE
+#endif
+
+// the distortion grid nodes are (1 << ARUCO_UNDISTORT_SHIFT) pixels apart. Use
+// a smaller spacing for lenses with very strong distortion
+#ifndef ARUCO_UNDISTORT_SHIFT
+#define ARUCO_UNDISTORT_SHIFT	4
+#endif
+
+// maximum number of bits that can be wrong on an aruco for it to be accepted
+// as the nearest database entry. The default of 0 only accepts exact matches.
+// A database with a minimum distance D between its codes (including their
+// rotations) can correct up to (D - 1) / 2 bits, but each bit corrected also
+// makes it more likely that a random pattern is accepted as an aruco
+#ifndef ARUCO_MAX_HAMMING
+#define ARUCO_MAX_HAMMING	0
+#endif
+
+// define ARUCO_COMPACT_DICTIONARY to 1 to store only the canonical rotation of
+// the arucos of ARUCO_DB in flash, instead of their 4 rotations. The code read
+// from each candidate is then rotated and looked up 4 times
+#ifndef ARUCO_COMPACT_DICTIONARY
+#define ARUCO_COMPACT_DICTIONARY	0
+#endif
+
+// maximum number of dictionaries searched on each frame (see add_dictionary())
+// and largest number of bits per side of their arucos, which sizes the bit
+// sampling buffers. It can't be more than 8
+#ifndef ARUCO_MAX_DICTIONARIES
+#define ARUCO_MAX_DICTIONARIES	4
+#endif
+
+#ifndef ARUCO_MAX_BITS
+#define ARUCO_MAX_BITS		ARUCO_BITS
+#endif
+
+#if (ARUCO_MAX_BITS < ARUCO_BITS || ARUCO_MAX_BITS > 8)
+#error invalid ARUCO_MAX_BITS, it must be between ARUCO_BITS and 8
+#endif
+
+// define ARUCO_QUALITY to 1 to compute quality metrics for each aruco found,
+// stored in the "quality" array next to the results
+#ifndef ARUCO_QUALITY
+#define ARUCO_QUALITY		0
+#endif
+
+// define ARUCO_TRACKING to 1 to follow the arucos from one frame to the next.
+// Their position on each frame is predicted from the two previous ones, and
+// only the windows around the predictions are processed, with a full frame
+// discovery pass from time to time (see aruco_tracking_t)
+#ifndef ARUCO_TRACKING
+#define ARUCO_TRACKING		0
+#endif
+
+// define ARUCO_INCREMENTAL to 1 for static cameras: the cells of each frame
+// that didn't change since they were last processed are skipped, and the
+// arucos found on them are kept (see aruco_incremental_t). It can't be used
+// together with ARUCO_TRACKING
+#ifndef ARUCO_INCREMENTAL
+#define ARUCO_INCREMENTAL	0
+#endif
+
+// define ARUCO_EXTERNAL_FRAME to 1 to process frames that are not stored on
+// the ArucoLite object, like a camera buffer, given with set_frame(). The
+// "frame" array then takes no space
+#ifndef ARUCO_EXTERNAL_FRAME
+#define ARUCO_EXTERNAL_FRAME	0
+#endif
+
+#if (ARUCO_TRACKING && ARUCO_INCREMENTAL)
+#error ARUCO_TRACKING and ARUCO_INCREMENTAL cannot be enabled at the same time
+#endif
+
+// select the numeric type used for the geometry (line fitting, corner
+// intersection and bit sampling):
+// - ARUCO_GEOMETRY_FLOAT uses single precision floating point
+// - ARUCO_GEOMETRY_FIXED uses 16.16 fixed point and no trigonometry, which is
+//   much faster on targets without a floating point unit, like the RP2040
+#define ARUCO_GEOMETRY_FLOAT	1
+#define ARUCO_GEOMETRY_FIXED	2
+
+#ifndef ARUCO_GEOMETRY
+#define ARUCO_GEOMETRY		ARUCO_GEOMETRY_FLOAT
+#endif
+
+// clock used for the deadline of process(deadline), in microseconds. It can
+// wrap around. By default it is micros() on Arduino, and a steady clock on
+// other platforms
+#ifndef ARUCO_MICROS
+#ifdef ARDUINO
+#define ARUCO_MICROS()		micros()
+#else
+#include <chrono>
+#define ARUCO_MICROS()		((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>( \
+					std::chrono::steady_clock::now().time_since_epoch()).count())
+#endif
+#endif
 
 #include "vector.h"
+#include "pose.h"
+#include "undistort.h"
+
+#if (ARUCO_GEOMETRY == ARUCO_GEOMETRY_FIXED)
+typedef fix16_t aruco_scalar_t;
+#else
+typedef float aruco_scalar_t;
+#endif
 
 // define debug colors
 enum {
@@ -82,45 +238,161 @@ static const uint8_t edge_table[256] = {
 };
 
 // structure to hold the information about one aruco
-struct aruco_t {
-	// corner point coordinates on the image (floating point, subpixel)
-	pt2d_t pt[4];
+template <class T>
+struct aruco_base_t {
+	// corner point coordinates on the image (subpixel)
+	pt2d_base_t<T> pt[4];
 	// integer id of this aruco on the database
 	int aruco_idx;
+	// index of the dictionary it was found on, in the order they were
+	// added (0 is the database selected with ARUCO_DB by default)
+	int dictionary;
+};
+
+// the results are always reported with floating point coordinates
+typedef aruco_base_t<float> aruco_t;
+
+// quality metrics of one aruco, computed if ARUCO_QUALITY is enabled
+struct aruco_quality_t {
+	// RMS distance of the contour points to the fitted sides, in pixels. The
+	// sides refined with ARUCO_EDGE_REFINE use the distance of the refined
+	// edge points to the refined side instead
+	float fit_residual;
+	// smallest difference between a bit sample and its threshold, in gray
+	// levels. Low values mean that some bit could easily flip
+	int bit_margin;
+	// number of bits that differ from the matched database entry
+	int hamming;
+	// in tracking mode, the arucos that keep their tracked id aren't read
+	// again, and both bit_margin and hamming are NOT_READ
+	static constexpr int NOT_READ = -1;
+	// apparent size: square root of the area of the aruco, in pixels
+	float size;
+};
+
+// thresholds used to drop candidate arucos before the expensive edge and
+// line fitting stages. They can be changed at any time between frames
+struct aruco_filter_t {
+	// minimum and maximum extent of an aruco (width and height of its
+	// bounding box) in pixels. The maximum can't be larger than 255
+	int min_size = 15;
+	int max_size = 255;
+	// maximum jump of the left or right border between two lines, in pixels
+	int max_jump = 50;
+	// minimum ratio between the dark area and the bounding box area. The
+	// border alone fills more than half of an aruco, and a 45 degree
+	// rotated square fills half of its bounding box
+	float min_fill = 0.15f;
+	// maximum ratio between the major and minor axis of the dark area,
+	// computed from its second order moments
+	float max_aspect = 5.0f;
+	// minimum ratio between the area enclosed by the left and right
+	// borders and the bounding box area. This is always above 0.5 for
+	// convex shapes
+	float min_convexity = 0.45f;
+};
+
+// settings of the tracking mode, used if ARUCO_TRACKING is enabled. They can
+// be changed at any time between frames
+struct aruco_tracking_t {
+	// process the whole frame every this many frames, to find the arucos
+	// that appeared since the last time. It is also processed whole when
+	// there is nothing to track or some tracked aruco was not found
+	int discovery_interval = 10;
+	// padding around the predicted corners of each aruco, in pixels. A
+	// quarter of the size of the aruco is added to it
+	int margin = 8;
+	// arucos whose 4 corners are at most this far from their predicted
+	// position (in pixels) keep their id without reading their bits
+	float max_error = 4.0f;
+};
+
+// settings of the incremental mode, used if ARUCO_INCREMENTAL is enabled. They
+// can be changed at any time between frames
+struct aruco_incremental_t {
+	// a cell changed if its average differs from the one it had when it
+	// was last processed by more than this, in gray levels
+	int threshold = 4;
+	// padding around the changed cells, in cells
+	int margin = 2;
+};
+
+// number of candidate arucos dropped by each stage on the last frame
+struct aruco_rejects_t {
+	int border;	// touching the frame border
+	int size;	// too small or too large
+	int jump;	// sudden jumps on the left or right border
+	int fill;	// too sparse for its bounding box
+	int aspect;	// too elongated
+	int convexity;	// not convex
+	int quad;	// couldn't fit a 4 sided polygon
+	int decode;	// the bits didn't match any allowed aruco on the database
+};
+
+// segment of dark pixels on one line of the frame, part of a candidate
+struct aruco_segment_t {
+	uint16_t y;
+	uint16_t start;
+	uint8_t length;	// HI-RES: we must support bigger lengths
+	uint8_t aruco;
+	int16_t next;	// HI-RES: we may need to support more than 64k segments
+};
+
+// an aruco followed from frame to frame in tracking mode. The corners are on
+// frame coordinates (before undistorting them) and in the same order as on
+// the results
+struct aruco_track_t {
+	pt2d_t last[4];		// where it was found on the last frame
+	pt2d_t pred[4];		// where it should be on the next one
+	int aruco_idx;
+	int dictionary;
+	int match;		// track it continues, or -1 for a new one
+};
+
+// the rows of a 2D buffer whose width is only known at run time
+template <class T>
+struct aruco_rows_t {
+	T *data;
+	int width;
+
+	T *operator[](int y) const { return data + y * width; }
 };
 
-template <int FRAME_WIDTH, int FRAME_HEIGHT, int MAX_ARUCO_COUNT = 16, bool DEBUG = false>
-class ArucoLite {
+// sizes and buffers of a detector for frames of WIDTH x HEIGHT pixels with up
+// to MAX_COUNT arucos, known when compiling. All of them are members of the
+// object, so it doesn't need any other memory
+template <int WIDTH, int HEIGHT, int MAX_COUNT, bool DEBUG>
+class aruco_buffers_t {
 public:
 	// publish the template parameters as constants
-	static constexpr int frame_width = FRAME_WIDTH;
-	static constexpr int frame_height = FRAME_HEIGHT;
-	static constexpr bool debug_mode = DEBUG;
+	static constexpr int frame_width = WIDTH;
+	static constexpr int frame_height = HEIGHT;
+	static constexpr int max_arucos = MAX_COUNT;
 
-	// the frame to be processed must be loaded to this array
-	uint8_t frame[FRAME_HEIGHT][FRAME_WIDTH];
+	// maximum number of contour points stored per candidate aruco (the
+	// memory they take is edge_memory, below). Candidates with longer
+	// contours are sampled uniformly to fit in this space
+	static constexpr int max_edge_points = (HEIGHT & 0xFFFFFFF8) * 4;
 
-	// the result of the frame processing is stored here
-	aruco_t result[MAX_ARUCO_COUNT];
-	int arucos_found;
+	// the frame to be processed must be loaded to this array, unless
+	// ARUCO_EXTERNAL_FRAME is enabled
+	uint8_t frame[HEIGHT * !ARUCO_EXTERNAL_FRAME][WIDTH * !ARUCO_EXTERNAL_FRAME];
 
-	// debug frame only occupies space if DEBUG is true
-	uint8_t debug_frame[FRAME_HEIGHT * DEBUG][FRAME_WIDTH * DEBUG];
+	// the result of the frame processing is stored here
+	aruco_t result[MAX_COUNT];
 
+	// quality of each result, only if ARUCO_QUALITY is enabled
+	aruco_quality_t quality[MAX_COUNT * ARUCO_QUALITY];
 
-	// process the frame in "frame" and fill in the aruco information
-	void process(void) {
-		debug_clear_frame();
-		compute_local_contrast();
-		build_segments();
-		process_finish();
-	}
+	// debug frame only occupies space if DEBUG is true
+	uint8_t debug_frame[HEIGHT * DEBUG][WIDTH * DEBUG];
 
 protected:
-	// some compile time computed constants
-	static constexpr int ARUCO_BORDER = 1;
-	static constexpr int TOTAL_BITS = (ARUCO_BITS + ARUCO_BORDER * 2);
-	static constexpr int DB_BYTES = (((ARUCO_BITS * ARUCO_BITS) + 7) / 8);
+	static constexpr bool DYNAMIC = false;
+
+	static constexpr int FRAME_WIDTH = WIDTH;
+	static constexpr int FRAME_HEIGHT = HEIGHT;
+	static constexpr int MAX_ARUCO_COUNT = MAX_COUNT;
 
 	static constexpr int USABLE_WIDTH = FRAME_WIDTH & 0xFFFFFFF8;
 	static constexpr int USABLE_HEIGHT = FRAME_HEIGHT & 0xFFFFFFF8;
@@ -131,17 +403,13 @@ protected:
 	static constexpr int FRAME_SIZE = FRAME_WIDTH * FRAME_HEIGHT;
 	static constexpr int USABLE_SIZE = USABLE_WIDTH * USABLE_HEIGHT;
 
-	// constants related to local contrast --------------------------------
-	static constexpr int CELL = 8;
-	static constexpr int GRID_X = USABLE_WIDTH / CELL;
-	static constexpr int GRID_Y = USABLE_HEIGHT / CELL;
-	static constexpr int DELTA = 5;
-
-	// constants related to edge processing --------------------------------
-	static constexpr int MAX_EDGE_PTS = USABLE_HEIGHT * 4;
-	static constexpr int ANGLE_DELTA = 4;
+	// the local contrast is computed on cells of 8x8 pixels
+	static constexpr int GRID_X = USABLE_WIDTH / 8;
+	static constexpr int GRID_Y = USABLE_HEIGHT / 8;
 
-	// constants related to segment processing -----------------------------
+	// maximum number of edge points stored per candidate aruco. Contours
+	// longer than this are decimated to fit
+	static constexpr int MAX_EDGE_PTS = max_edge_points;
 
 	// maximum number of arucos we can try to find in one frame. Note that
 	// this includes early processing of black areas that don't end up
@@ -153,17 +421,33 @@ protected:
 	static constexpr int MAX_SEGMENTS = (USABLE_SIZE / 50 < 65535) ? USABLE_SIZE / 50 : 65535;
 	static constexpr int MAX_SEGS_PER_LINE = USABLE_WIDTH / 6;
 
+	// maximum number of windows processed on one frame, by the tracking or
+	// incremental modes
+	static constexpr int MAX_WINDOWS = GRID_Y + MAX_ARUCO_COUNT;
+
+	// tracking data, only if ARUCO_TRACKING is enabled. The arucos tracked
+	// from the previous frames, and the ones found on this frame, which
+	// replace them at the end of it
+	aruco_track_t tracks[MAX_ARUCO_COUNT * ARUCO_TRACKING];
+	aruco_track_t found[MAX_ARUCO_COUNT * ARUCO_TRACKING];
+
+	// incremental mode data, only if ARUCO_INCREMENTAL is enabled. The sum
+	// of the pixels of each cell on this frame, and on the frame where it
+	// was last processed (if there is one)
+	uint16_t cell_sum[GRID_Y * ARUCO_INCREMENTAL][GRID_X * ARUCO_INCREMENTAL];
+	uint16_t cell_reference[GRID_Y * ARUCO_INCREMENTAL][GRID_X * ARUCO_INCREMENTAL];
+	// window of cells around each result. The arucos whose window doesn't
+	// overlap the changed cells are kept on the next frame
+	int footprint[MAX_ARUCO_COUNT * ARUCO_INCREMENTAL][4];
+
+	// bounding box (x0, y0, x1, y1) of the corners of each result on the
+	// frame, before undistorting them, and the boxes of the previous frame,
+	// copied when a frame with a deadline starts
+	int16_t result_box[MAX_ARUCO_COUNT][4];
+	int16_t previous_box[MAX_ARUCO_COUNT][4];
 
 	// segment processing data ---------------------------------------------
 
-	struct segment_t {
-		uint16_t y;
-		uint16_t start;
-		uint8_t length;	// HI-RES: we must support bigger lengths
-		uint8_t aruco;
-		int16_t next;	// HI-RES: we may need to support more than 64k segments
-	};
-
 	struct line_segments_t {
 		uint16_t idx[MAX_SEGS_PER_LINE];
 		uint16_t count;
@@ -176,10 +460,11 @@ protected:
 			uint32_t lc_sum[GRID_Y][GRID_X];
 		};
 		struct {
-			segment_t segments[MAX_SEGMENTS];
+			aruco_segment_t segments[MAX_SEGMENTS];
 			int segment_count, free_segment;
 
 			int16_t arucos[MAX_ARUCOS], aruco_seg_count[MAX_ARUCOS];
+			int16_t aruco_y_start[MAX_ARUCOS];
 			int aruco_count, free_aruco;
 
 			line_segments_t previous_line, new_line;
@@ -204,63 +489,663 @@ protected:
 		};
 	};
 	int16_t edge[MAX_EDGE_PTS][2];
+
+public:
+	// memory taken by the contour points of a candidate: the points, and
+	// their angles, which share their space with first / last
+	static constexpr int edge_memory = sizeof(edge) +
+		(sizeof(edge_angle) + sizeof(edge_bucket) > sizeof(first) + sizeof(last) + sizeof(y_start) + sizeof(y_end) ?
+		 sizeof(edge_angle) + sizeof(edge_bucket) : sizeof(first) + sizeof(last) + sizeof(y_start) + sizeof(y_end));
+};
+
+// the same sizes and buffers for a frame size and a number of arucos given at
+// run time with init(). The sizes are members with the names of the
+// constants above, and the buffers are carved out of an arena given by the
+// caller, so the detector never allocates memory
+template <bool DEBUG>
+class aruco_buffers_t<0, 0, 0, DEBUG> {
+public:
+	int frame_width = 0;
+	int frame_height = 0;
+	int max_arucos = 0;
+	int max_edge_points = 0;
+	int edge_memory = 0;
+
+	// the frame is always external, given with set_frame()
+	aruco_rows_t<uint8_t> frame;
+
+	// the result of the frame processing, and its quality if ARUCO_QUALITY
+	// is enabled, on the arena
+	aruco_t *result = nullptr;
+	aruco_quality_t *quality = nullptr;
+
+	// there is no debug frame
+	aruco_rows_t<uint8_t> debug_frame;
+
+	// bytes of arena needed to process frames of width x height pixels,
+	// with up to max_count arucos
+	static size_t required_bytes(int width, int height, int max_count) {
+		aruco_buffers_t b;
+		return b.layout(width, height, max_count, nullptr);
+	}
+
+	// set the frame size and the maximum number of arucos, and carve the
+	// buffers out of "arena", which must stay valid while the detector is
+	// used. Returns false if the arena is smaller than required_bytes()
+	bool init(int width, int height, int max_count, void *arena, size_t bytes) {
+		if (width < 16 || height < 16 || max_count < 1 ||
+		    layout(width, height, max_count, nullptr) > bytes)
+			return false;
+		layout(width, height, max_count, (uint8_t *)arena);
+		return true;
+	}
+
+protected:
+	static constexpr bool DYNAMIC = true;
+
+	int FRAME_WIDTH = 0, FRAME_HEIGHT = 0, MAX_ARUCO_COUNT = 0;
+	int USABLE_WIDTH, USABLE_HEIGHT;
+	int FRAME_MARGIN_X, FRAME_MARGIN_Y;
+	int FRAME_SIZE, USABLE_SIZE;
+	int GRID_X, GRID_Y;
+	int MAX_EDGE_PTS;
+	int MAX_ARUCOS, MAX_SEGMENTS, MAX_SEGS_PER_LINE;
+
+	// the tracking and incremental modes are not available
+	static constexpr int MAX_WINDOWS = 1;
+	aruco_track_t *tracks = nullptr, *found = nullptr;
+	aruco_rows_t<uint16_t> cell_sum, cell_reference;
+	int (*footprint)[4] = nullptr;
+
+	int16_t (*result_box)[4], (*previous_box)[4];
+
+	struct line_segments_t {
+		uint16_t *idx;
+		uint16_t count;
+	};
+
+	// the same data sharing as with the sizes known when compiling, with
+	// the buffers on the same parts of the arena
+	aruco_rows_t<uint32_t> lc_sum;
+	aruco_segment_t *segments;
+	int segment_count, free_segment;
+	int16_t *arucos, *aruco_seg_count, *aruco_y_start;
+	int aruco_count, free_aruco;
+	line_segments_t previous_line, new_line;
+
+	aruco_rows_t<uint8_t> lc_grid;
+
+	int16_t *first, *last;
+	int y_start, y_end;
+	uint8_t *edge_angle;
+	uint16_t edge_bucket[32];
+	int16_t (*edge)[2];
+
+	// reserve "count" elements of type T at "offset" bytes on the arena, if
+	// there is one, and return the offset of the next free byte
+	template <class T>
+	static size_t carve(uint8_t *arena, size_t offset, size_t count, T *&ptr) {
+		offset = (offset + alignof(T) - 1) & ~(alignof(T) - 1);
+		if (arena != nullptr)
+			ptr = (T *)(arena + offset);
+		return offset + count * sizeof(T);
+	}
+
+	// compute the sizes like the constants above, and place the buffers on
+	// the arena if there is one. Returns the number of bytes used
+	size_t layout(int width, int height, int max_count, uint8_t *arena) {
+		size_t offset = 0, shared, edges;
+		uint32_t *sum = nullptr;
+		uint8_t *grid = nullptr;
+
+		FRAME_WIDTH = width;
+		FRAME_HEIGHT = height;
+		MAX_ARUCO_COUNT = max_count;
+		USABLE_WIDTH = FRAME_WIDTH & 0xFFFFFFF8;
+		USABLE_HEIGHT = FRAME_HEIGHT & 0xFFFFFFF8;
+		FRAME_MARGIN_X = (FRAME_WIDTH - USABLE_WIDTH) / 2;
+		FRAME_MARGIN_Y = (FRAME_HEIGHT - USABLE_HEIGHT) / 2;
+		FRAME_SIZE = FRAME_WIDTH * FRAME_HEIGHT;
+		USABLE_SIZE = USABLE_WIDTH * USABLE_HEIGHT;
+		GRID_X = USABLE_WIDTH / 8;
+		GRID_Y = USABLE_HEIGHT / 8;
+		MAX_EDGE_PTS = USABLE_HEIGHT * 4;
+		// the candidate of each segment is stored in a byte
+		MAX_ARUCOS = USABLE_SIZE / 850 < 255 ? USABLE_SIZE / 850 : 255;
+		MAX_SEGMENTS = (USABLE_SIZE / 50 < 65535) ? USABLE_SIZE / 50 : 65535;
+		MAX_SEGS_PER_LINE = USABLE_WIDTH / 6;
+
+		frame_width = FRAME_WIDTH;
+		frame_height = FRAME_HEIGHT;
+		max_arucos = MAX_ARUCO_COUNT;
+		max_edge_points = MAX_EDGE_PTS;
+
+		offset = carve(arena, offset, MAX_ARUCO_COUNT, result);
+		offset = carve(arena, offset, MAX_ARUCO_COUNT * ARUCO_QUALITY, quality);
+		offset = carve(arena, offset, MAX_ARUCO_COUNT, result_box);
+		offset = carve(arena, offset, MAX_ARUCO_COUNT, previous_box);
+
+		// lc_sum shares its space with the segments
+		shared = carve(arena, offset, GRID_X * GRID_Y, sum);
+		lc_sum.data = sum;
+		lc_sum.width = GRID_X;
+		offset = carve(arena, offset, MAX_SEGMENTS, segments);
+		offset = carve(arena, offset, MAX_ARUCOS, arucos);
+		offset = carve(arena, offset, MAX_ARUCOS, aruco_seg_count);
+		offset = carve(arena, offset, MAX_ARUCOS, aruco_y_start);
+		offset = carve(arena, offset, MAX_SEGS_PER_LINE, previous_line.idx);
+		offset = carve(arena, offset, MAX_SEGS_PER_LINE, new_line.idx);
+		if (shared > offset)
+			offset = shared;
+
+		offset = carve(arena, offset, GRID_X * GRID_Y, grid);
+		lc_grid.data = grid;
+		lc_grid.width = GRID_X;
+
+		// and first / last with edge_angle. The contour points take all
+		// the space from there, plus edge_bucket
+		edges = offset;
+		shared = carve(arena, offset, MAX_EDGE_PTS, edge_angle);
+		offset = carve(arena, offset, FRAME_HEIGHT, first);
+		offset = carve(arena, offset, FRAME_HEIGHT, last);
+		if (shared > offset)
+			offset = shared;
+
+		offset = carve(arena, offset, MAX_EDGE_PTS, edge);
+		edge_memory = offset - edges + sizeof(edge_bucket);
+		return offset;
+	}
+};
+
+// the detector, for frames of WIDTH x HEIGHT pixels with up to MAX_COUNT
+// arucos. ArucoLite<0, 0, 0> takes the frame size and the number of arucos at
+// run time instead (see aruco_buffers_t<0, 0, 0>::init())
+template <int WIDTH, int HEIGHT, int MAX_COUNT = 16, bool DEBUG = false>
+class ArucoLite : public aruco_buffers_t<WIDTH, HEIGHT, MAX_COUNT, DEBUG> {
+	typedef aruco_buffers_t<WIDTH, HEIGHT, MAX_COUNT, DEBUG> buffers_t;
+
+public:
+	static constexpr bool debug_mode = DEBUG;
+
+	// tables of the database selected with ARUCO_DB, generated when
+	// compiling. builtin_dictionary::dictionary is the default dictionary
+	typedef aruco_dictionary_tables_t<ARUCO_DB_SIZE, ARUCO_BITS, database_codes,
+					  ARUCO_COMPACT_DICTIONARY ? 1 : 4> builtin_dictionary;
+
+	// the frame, the results and their quality are on buffers_t
+	using buffers_t::frame;
+	using buffers_t::result;
+	using buffers_t::quality;
+	using buffers_t::debug_frame;
+	using buffers_t::max_edge_points;
+
+	// number of arucos found on the last frame
+	int arucos_found;
+
+	// number of candidates on the last frame whose contour was longer than
+	// max_edge_points and had to be decimated
+	int edges_decimated;
+
+	// candidate filtering thresholds and how many candidates each stage
+	// rejected on the last frame
+	aruco_filter_t filter;
+	aruco_rejects_t rejects;
+
+	// lens distortion correction, used if ARUCO_UNDISTORT is enabled. Call
+	// undistort.init() with the camera calibration before processing
+	aruco_undistort_t<ARUCO_UNDISTORT ? WIDTH : 0, ARUCO_UNDISTORT ? HEIGHT : 0,
+			  ARUCO_UNDISTORT_SHIFT> undistort;
+
+	// stop processing the candidates of a frame as soon as every allowed id
+	// of every dictionary has been found (see set_allowed_ids()). This is
+	// only useful if all the dictionaries have an allow list
+	bool stop_when_all_found = false;
+
+	// tracking and incremental mode settings, only used if ARUCO_TRACKING
+	// or ARUCO_INCREMENTAL are enabled, and whether the last frame was
+	// processed whole
+	aruco_tracking_t tracking;
+	aruco_incremental_t incremental;
+	bool discovery;
+	// number of cells that changed on the last frame, in incremental mode
+	int cells_changed;
+
+	// the deadline of the last frame passed before it was completely
+	// processed, so some arucos may be missing from the results
+	bool incomplete;
+
+
+	ArucoLite() {
+		frame_data = nullptr;
+		frame_stride = FRAME_WIDTH;
+		has_deadline = false;
+		arucos_found = 0;
+		set_dictionary(&builtin_dictionary::dictionary);
+	}
+
+	// process the frame in "frame" and fill in the aruco information. In
+	// tracking mode, only the windows around the tracked arucos are
+	// processed, except on discovery frames
+	void process(void) {
+		debug_clear_frame();
+		if (INCREMENTAL) {
+			process_changes();
+			return;
+		}
+		start_frame();
+
+		discovery = !TRACKING || track_lost || track_count == 0 ||
+			    frames_since_discovery >= tracking.discovery_interval;
+		if (discovery) {
+			frames_since_discovery = 0;
+			set_window(0, 0, GRID_X, GRID_Y);
+			process_window();
+		} else {
+			process_tracks();
+		}
+
+		if (TRACKING) {
+			frames_since_discovery++;
+			update_tracks();
+		}
+	}
+
+	// process the frame at "data" instead of "frame", if ARUCO_EXTERNAL_FRAME
+	// is enabled (and always with ArucoLite<0, 0, 0>). Its rows are "stride" bytes apart (at least "width"), and
+	// a negative stride processes the rows bottom up, starting with the one
+	// at "data", for sensors that are mounted upside down. The frame isn't
+	// copied, so it must stay unchanged while it is processed. Returns false
+	// if the size is not the one of the template (or of init())
+	bool set_frame(const uint8_t *data, int width, int height, int stride) {
+		if (!EXTERNAL_FRAME || width != FRAME_WIDTH || height != FRAME_HEIGHT ||
+		    (stride < 0 ? -stride : stride) < width)
+			return false;
+		frame_data = data;
+		frame_stride = stride;
+		return true;
+	}
+
+	// process the frame, but stop as soon as possible once ARUCO_MICROS()
+	// reaches "deadline", keeping the arucos decoded until then. The
+	// deadline is checked between stages, every row of cells and between
+	// candidates, which are processed from the largest to the smallest,
+	// after the ones near the arucos of the last frame. Returns false if
+	// the frame is incomplete
+	bool process(uint32_t deadline) {
+		has_deadline = true;
+		frame_deadline = deadline;
+		process();
+		has_deadline = false;
+		return !incomplete;
+	}
+
+	// forget the tracked arucos, or the reference of the incremental mode,
+	// so that the next frame is processed whole. Call it when the camera or
+	// the scene change abruptly
+	void reset_tracking(void) {
+		track_count = 0;
+		track_lost = false;
+		frames_since_discovery = 0;
+		has_reference = false;
+	}
+
+	// use a dictionary other than the one selected with ARUCO_DB, for
+	// example loaded from a file, instead of all the current ones. It must
+	// have arucos of at most ARUCO_MAX_BITS x ARUCO_MAX_BITS cells, and
+	// stay valid while it is used. Returns false (and keeps the current
+	// dictionaries) if it doesn't
+	bool set_dictionary(const aruco_dictionary_t *dict) {
+		if (dict->bits > MAX_BITS)
+			return false;
+		dictionary_count = 0;
+		grid_totals = 0;
+		add_dictionary(dict);
+		// the tracked or kept arucos refer to the old dictionaries
+		reset_tracking();
+		return true;
+	}
+
+	// search the arucos of one more dictionary on each frame, which can
+	// have a different number of bits than the others. The candidates are
+	// found and fitted once, and their bits are read once per grid size
+	// (from the largest to the smallest) and looked up on each dictionary
+	// of that size, in the order they were added. Returns the index of the
+	// dictionary, which is stored in the results, or -1 if there is no
+	// space for it or its arucos have more than ARUCO_MAX_BITS bits
+	int add_dictionary(const aruco_dictionary_t *dict) {
+		if (dictionary_count >= MAX_DICTIONARIES || dict->bits > MAX_BITS)
+			return -1;
+
+		// the sampling positions on the unit square don't depend on
+		// the aruco, so convert them to scalar_t only once. The gray
+		// samples are spread evenly over the central half of each cell
+		grid_t &g = grid[dictionary_count];
+		int total = dict->bits + ARUCO_BORDER * 2;
+		float spacing = 0.5f / ((BIT_SAMPLES > 0 ? BIT_SAMPLES : 1) * total);
+
+		g.total = total;
+		g.step = scalar_t(1.0f / total);
+		g.half = scalar_t(0.5f / total);
+		g.first = scalar_t(0.25f / total + spacing * 0.5f);
+		g.spacing = scalar_t(spacing);
+
+		grid_totals |= 1 << total;
+		dictionaries[dictionary_count] = dict;
+		allowed[dictionary_count] = nullptr;
+		allowed_count[dictionary_count] = dict->size;
+		return dictionary_count++;
+	}
+
+	// only accept the arucos of dictionary "d" whose id is set on "ids", a
+	// bitset with the bit (id & 31) of ids[id / 32] for each id, which must
+	// stay valid while it is used. nullptr accepts all the arucos. The ids
+	// are checked right after the lookup, so the codes of arucos that are
+	// not allowed cost the same as codes that are not on the dictionary.
+	// Returns false if "d" is not the index of a dictionary
+	bool set_allowed_ids(int d, const uint32_t *ids) {
+		int id;
+
+		if (d < 0 || d >= dictionary_count)
+			return false;
+		allowed[d] = ids;
+		allowed_count[d] = dictionaries[d]->size;
+		if (ids != nullptr)
+			for (id = 0; id < dictionaries[d]->size; id++)
+				if ((ids[id >> 5] & (1u << (id & 31))) == 0)
+					allowed_count[d]--;
+		return true;
+	}
+
+	// estimate the pose of each aruco in "result" from its corners, given
+	// the camera intrinsics and the side length of the arucos (the
+	// translation is in the same units). pose[i] is the pose of result[i].
+	// The solver uses the same numeric type as the geometry
+	void estimate_poses(const aruco_camera_t &cam, float side, aruco_pose_t *pose)
+	{
+		aruco_pose_solver_t<scalar_t> solver;
+		aruco_pose_base_t<scalar_t> batch[aruco_pose_solver_t<scalar_t>::POSE_LANES];
+		int i, j, start;
+
+		for (start = 0; start < arucos_found; start = i) {
+			for (i = start; i < arucos_found && solver.add(cam, result[i].pt); i++)
+				;
+			solver.solve(cam, side, batch);
+			for (j = start; j < i; j++)
+				pose[j].set(batch[j - start]);
+		}
+	}
+
+protected:
+	// geometry types used internally, selected by ARUCO_GEOMETRY
+	typedef aruco_scalar_t scalar_t;
+	typedef pt2d_base_t<scalar_t> point_t;
+	typedef line2d_base_t<scalar_t> line_t;
+	typedef line_fit_base_t<scalar_t> fit_t;
+	typedef aruco_base_t<scalar_t> candidate_t;
+
+	// some compile time computed constants
+	static constexpr int ARUCO_BORDER = 1;
+	static constexpr int MAX_BITS = ARUCO_MAX_BITS;
+	static constexpr int MAX_TOTAL_BITS = (MAX_BITS + ARUCO_BORDER * 2);
+	static constexpr int MAX_DICTIONARIES = ARUCO_MAX_DICTIONARIES;
+
+	// sizes of the frame and the buffers, constants unless DYNAMIC
+	using buffers_t::DYNAMIC;
+	using buffers_t::FRAME_WIDTH;
+	using buffers_t::FRAME_HEIGHT;
+	using buffers_t::MAX_ARUCO_COUNT;
+	using buffers_t::USABLE_WIDTH;
+	using buffers_t::USABLE_HEIGHT;
+	using buffers_t::FRAME_MARGIN_X;
+	using buffers_t::FRAME_MARGIN_Y;
+	using buffers_t::FRAME_SIZE;
+	using buffers_t::GRID_X;
+	using buffers_t::GRID_Y;
+	using buffers_t::MAX_EDGE_PTS;
+	using buffers_t::MAX_ARUCOS;
+	using buffers_t::MAX_SEGMENTS;
+	using buffers_t::MAX_SEGS_PER_LINE;
+	using buffers_t::MAX_WINDOWS;
+
+	// constants related to local contrast --------------------------------
+	static constexpr int CELL = 8;
+	static constexpr int DELTA = 5;
+
+	// constants related to edge processing --------------------------------
+	static constexpr int ANGLE_DELTA = 4;
+	static constexpr int QUAD_FINDER = ARUCO_QUAD_FINDER;
+
+	// constants related to robust fitting ---------------------------------
+	static constexpr int ROBUST_ITERATIONS = ARUCO_ROBUST_FIT;
+	// edge points closer than this to the line (in pixels) get full weight
+	static constexpr float ROBUST_DELTA = 1.0f; //PARAM
+
+	// constants related to edge refinement -------------------------------
+	static constexpr int REFINE_SAMPLES = ARUCO_EDGE_REFINE;
+	// the gradient is searched for in [-REFINE_RANGE, REFINE_RANGE] pixels
+	// across the side, in steps of 1/REFINE_STEPS pixels
+	static constexpr int REFINE_RANGE = 3;
+	static constexpr int REFINE_STEPS = 2;
+	static constexpr int REFINE_POINTS = REFINE_RANGE * REFINE_STEPS * 2 + 1;
+	static constexpr int REFINE_MIN_CONTRAST = 20;
+	// the samples are spread evenly over the middle 60% of each side
+	static constexpr float REFINE_SPACING = 0.6f / (REFINE_SAMPLES > 0 ? REFINE_SAMPLES : 1);
+
+	static constexpr int UNDISTORT = ARUCO_UNDISTORT;
+	static constexpr bool QUALITY = ARUCO_QUALITY;
+	static constexpr bool TRACKING = ARUCO_TRACKING;
+	static constexpr bool INCREMENTAL = ARUCO_INCREMENTAL;
+	// the frame of a DYNAMIC detector is always external
+	static constexpr bool EXTERNAL_FRAME = ARUCO_EXTERNAL_FRAME || DYNAMIC;
+	static_assert(!DYNAMIC || (!DEBUG && !TRACKING && !INCREMENTAL && !UNDISTORT),
+		      "the debug, tracking, incremental and undistort modes need the frame size when compiling");
+	static constexpr int MAX_HAMMING = ARUCO_MAX_HAMMING;
+
+	// constants related to grayscale bit sampling ------------------------
+	static constexpr int BIT_SAMPLES = ARUCO_BIT_SAMPLES;
+	// minimum difference between the black border and the white cells
+	static constexpr int BIT_MIN_CONTRAST = 20; //PARAM
+	// scale of the cell sums: 256 times the number of samples per cell
+	static constexpr int BIT_CELL_SCALE = 256 * (BIT_SAMPLES > 0 ? BIT_SAMPLES * BIT_SAMPLES : 1);
+
+	// sampling positions of the cells of an aruco with "total" cells per
+	// side (including the border), on the unit square
+	struct grid_t {
+		int total;
+		scalar_t step;		// size of a cell
+		scalar_t half;		// half a cell, the center of the first one
+		scalar_t first;		// first gray sample of a cell
+		scalar_t spacing;	// between the gray samples of a cell
+	};
+
+	// dictionaries used to identify the arucos, and their sampling grids
+	const aruco_dictionary_t *dictionaries[MAX_DICTIONARIES];
+	grid_t grid[MAX_DICTIONARIES];
+	int dictionary_count;
+	// bit "total" is set if there is a grid with "total" cells per side
+	int grid_totals;
+	// allowed ids of each dictionary (nullptr if all are) and their number
+	const uint32_t *allowed[MAX_DICTIONARIES];
+	int allowed_count[MAX_DICTIONARIES];
+	// number of different allowed arucos found on this frame
+	int allowed_found;
+
+	// quality metrics of the current candidate, if QUALITY is enabled:
+	// mean squared residual of the fit of each side (replaced by the fit
+	// of the refined points when the side is refined), smallest bit
+	// margin (in gray levels) and hamming distance of the match
+	scalar_t cand_residual[4];
+	int cand_margin;
+	int cand_hamming;
+	// rotation of the current candidate found when decoding it
+	int cand_rotation;
+
+	// tracking data, only if TRACKING is enabled --------------------------
+
+	// arucos tracked from the previous frames (on "tracks"), and the ones
+	// found on this frame (on "found"), which replace them at the end of it
+	typedef aruco_track_t track_t;
+	using buffers_t::tracks;
+	using buffers_t::found;
+	int track_count;
+	// some tracked aruco was not found on the last frame
+	bool track_lost;
+	int frames_since_discovery;
+
+	// frame given with set_frame(), if EXTERNAL_FRAME is enabled
+	const uint8_t *frame_data;
+	ptrdiff_t frame_stride;
+
+	// deadline of the current frame, if it has one
+	bool has_deadline;
+	uint32_t frame_deadline;
+	// number of arucos found on the previous frame, and where they were
+	// (on previous_box), to process the candidates near them first
+	int previous_found;
+	using buffers_t::result_box;
+	using buffers_t::previous_box;
+
+	// incremental mode data, only if INCREMENTAL is enabled ---------------
+
+	// the cell sums of this frame and of the reference, and the window of
+	// cells around each result
+	using buffers_t::cell_sum;
+	using buffers_t::cell_reference;
+	using buffers_t::footprint;
+	bool has_reference;
+
+	// segment processing data, on buffers_t -------------------------------
+
+	typedef aruco_segment_t segment_t;
+	using buffers_t::lc_sum;
+	using buffers_t::segments;
+	using buffers_t::segment_count;
+	using buffers_t::free_segment;
+	using buffers_t::arucos;
+	using buffers_t::aruco_seg_count;
+	using buffers_t::aruco_y_start;
+	using buffers_t::aruco_count;
+	using buffers_t::free_aruco;
+	using buffers_t::previous_line;
+	using buffers_t::new_line;
+	using buffers_t::lc_grid;
+
+	// window of the frame being processed, in cells: [win_x0, win_x1) x
+	// [win_y0, win_y1). Only the thresholds of its cells are valid, and
+	// only the arucos that are completely inside it are found
+	int win_x0, win_y0, win_x1, win_y1;
+	int sum_x0, sum_y0;
+
+	// the borders and edge points of the current candidate, on buffers_t
+	using buffers_t::first;
+	using buffers_t::last;
+	using buffers_t::y_start;
+	using buffers_t::y_end;
+	using buffers_t::edge_angle;
+	using buffers_t::edge_bucket;
+	using buffers_t::edge;
 	uint16_t edge_count;
+	uint16_t edge_stride, edge_skip;
+
+
+	// access to the frame being processed, stored on "frame" or external
+	const uint8_t *frame_row(int y)
+	{
+		if (EXTERNAL_FRAME)
+			return frame_data + y * frame_stride;
+		return frame[y];
+	}
 
+	ptrdiff_t row_stride(void)
+	{
+		return EXTERNAL_FRAME ? frame_stride : FRAME_WIDTH;
+	}
 
 	// methods to compute local contrast
 
+	// the sums in lc_sum start at cell (sum_y0, sum_x0)
 	int get_lc_sum(int y, int x)
 	{
-		if (y < 0)
+		if (y < sum_y0)
 			return 0;
-		if (x < 0)
+		if (x < sum_x0)
 			return 0;
 		return lc_sum[y][x];
 	}
 
-	void compute_local_contrast(void)
+	// the threshold of a cell is computed around the nearest cell that is
+	// at least DELTA cells away from the border
+	static int lc_center(int v, int grid_size)
 	{
-		uint32_t total, gy, gx, ix, iy, x, y, avg;
+		if (v < DELTA)
+			v = DELTA;
+		if (v > grid_size - DELTA - 1)
+			v = grid_size - DELTA - 1;
+		return v;
+	}
 
-		for (gy = 0; gy < GRID_Y; gy++) {
-			x = FRAME_MARGIN_X;
-			for (gx = 0; gx < GRID_X; gx++) {
-				total = 0;
-				y = gy * CELL + FRAME_MARGIN_Y;
+	// compute the thresholds of the cells of the window
+	void compute_local_contrast(void)
+	{
+		uint32_t total, ix, iy, avg, *sum, *above;
+		int gy, gx, x, y, sum_y1, sum_x1;
+		const uint8_t *ptr, *pix;
+		ptrdiff_t stride;
+
+		// only sum the cells the thresholds of the window need
+		sum_y0 = lc_center(win_y0, GRID_Y) - DELTA + 1;
+		sum_x0 = lc_center(win_x0, GRID_X) - DELTA + 1;
+		sum_y1 = lc_center(win_y1 - 1, GRID_Y) + DELTA;
+		sum_x1 = lc_center(win_x1 - 1, GRID_X) + DELTA;
+		if (sum_y0 < 0)
+			sum_y0 = 0;
+		if (sum_x0 < 0)
+			sum_x0 = 0;
+		if (sum_y1 > GRID_Y - 1)
+			sum_y1 = GRID_Y - 1;
+		if (sum_x1 > GRID_X - 1)
+			sum_x1 = GRID_X - 1;
+
+		// the rows are accessed through pointers and the sizes copied
+		// to locals, as the stores to lc_sum could otherwise change them
+		// when they are not constants (DYNAMIC)
+		stride = row_stride();
+		for (gy = sum_y0; gy <= sum_y1; gy++) {
+			if (deadline_passed())
+				return;
+			sum = &lc_sum[gy][0];
+			above = &lc_sum[gy > sum_y0 ? gy - 1 : gy][0];
+			ptr = frame_row(gy * CELL + FRAME_MARGIN_Y) + FRAME_MARGIN_X;
+			for (gx = sum_x0; gx <= sum_x1; gx++) {
+				if (INCREMENTAL) {
+					// already summed to find the changes
+					total = cell_sum[gy][gx];
+				} else {
+					total = 0;
+					pix = ptr + gx * CELL;
 
-				for (iy = 0; iy < CELL; iy++, y++) {
-					for (ix = 0; ix < CELL; ix++, x++)
-						total += frame[y][x];
-					x -= CELL;
+					for (iy = 0; iy < CELL; iy++, pix += stride)
+						for (ix = 0; ix < CELL; ix++)
+							total += pix[ix];
 				}
 
-				x += CELL;
-
-				if (gy != 0)
-					total += lc_sum[gy - 1][gx];
-				if (gx != 0)
-					total += lc_sum[gy][gx - 1];
-				if (gx != 0 && gy != 0)
-					total -= lc_sum[gy - 1][gx - 1];
+				if (gy != sum_y0)
+					total += above[gx];
+				if (gx != sum_x0)
+					total += sum[gx - 1];
+				if (gx != sum_x0 && gy != sum_y0)
+					total -= above[gx - 1];
 
-				lc_sum[gy][gx] = total;
+				sum[gx] = total;
 			}
 		}
 
 
-		for (y = 0; y < GRID_Y; y++) {
-			gy = y;
-			if (gy < DELTA)
-				gy = DELTA;
-			if (gy > GRID_Y - DELTA - 1)
-				gy = GRID_Y - DELTA - 1;
+		for (y = win_y0; y < win_y1; y++) {
+			gy = lc_center(y, GRID_Y);
 
-			for (x = 0; x < GRID_X; x++) {
-				gx = x;
-				if (gx < DELTA)
-					gx = DELTA;
-				if (gx > GRID_X - DELTA - 1)
-					gx = GRID_X - DELTA - 1;
+			for (x = win_x0; x < win_x1; x++) {
+				gx = lc_center(x, GRID_X);
 
 				avg = (get_lc_sum(gy-5, gx-5) + get_lc_sum(gy+5, gx+5) -
 					get_lc_sum(gy-5, gx+5) - get_lc_sum(gy+5, gx-5)) /
@@ -384,6 +1269,8 @@ protected:
 		arucos[merge] = -1;
 
 		aruco_seg_count[main] += aruco_seg_count[merge];
+		if (aruco_y_start[merge] < aruco_y_start[main])
+			aruco_y_start[main] = aruco_y_start[merge];
 
 		dealloc_aruco(merge);
 
@@ -391,16 +1278,26 @@ protected:
 	}
 
 
-	void check_valid_aruco_and_drop(int idx)
+	void check_valid_aruco_and_drop(int idx, int y_end)
 	{
+		int height;
+
 		// if it's already deleted, just return
 		if (aruco_seg_count[idx] == -1)
 			return;
 		// if the whole "aruco" has less than 20 segments, it's not good
 		// and needs to be dropped
-		if (aruco_seg_count[idx] > 20)
+		if (aruco_seg_count[idx] <= 20) {
+			dealloc_aruco(idx);
 			return;
-		dealloc_aruco(idx);
+		}
+		// drop it as soon as it ends if its height is out of range, to
+		// release the segments for the rest of the frame
+		height = y_end - aruco_y_start[idx];
+		if (height < filter.min_size || height > filter.max_size) {
+			rejects.size++;
+			dealloc_aruco(idx);
+		}
 	}
 
 
@@ -419,7 +1316,7 @@ protected:
 					break;
 			}
 			if (j == new_line.count)
-				check_valid_aruco_and_drop(prev_seg->aruco);
+				check_valid_aruco_and_drop(prev_seg->aruco, prev_seg->y);
 		}
 
 		// move the new line data to previous line
@@ -444,11 +1341,10 @@ protected:
 		segment_t *seg, *new_seg;
 		int i, new_seg_idx, aruco_idx;
 
-		// don't accept segments larger than 255 pixels: we would need
-		// more than one byte to store them and they are unlikely to be
-		// from a valid aruco as it would have to fill almost the entire
-		// frame
-		if (x2 - x1 > 255)
+		// don't accept segments wider than the largest aruco. This also
+		// means we never need more than one byte to store the length,
+		// as max_size is at most 255
+		if (x2 - x1 > filter.max_size || x2 - x1 > 255)
 			return;
 
 		mono_frame_draw_black_segment(y, x1, x2);
@@ -488,6 +1384,7 @@ protected:
 				dealloc_segment(new_seg_idx);
 				return;
 			}
+			aruco_y_start[aruco_idx] = y;
 			aruco_add_segment(aruco_idx, new_seg_idx, new_seg);
 		}
 	}
@@ -496,7 +1393,8 @@ protected:
 	{
 		uint32_t x, y, ix, py, px, avg, edge;
 		int segment_start;
-		uint8_t *ptr, *frame_ptr;
+		uint8_t *ptr;
+		const uint8_t *frame_ptr;
 		uint8_t shift, cell_shift = 0;
 
 		segment_count = 0;
@@ -507,15 +1405,17 @@ protected:
 		previous_line.count = 0;
 		new_line.count = 0;
 
-		for (y = 0; y < USABLE_HEIGHT; y++) {
+		for (y = win_y0 * CELL; y < (uint32_t)(win_y1 * CELL); y++) {
+			if ((y & (CELL - 1)) == 0 && deadline_passed())
+				return;
 			py = y + FRAME_MARGIN_Y;
 			ptr = lc_grid[y / CELL];
 			segment_start = -1;
 			shift = 0xAA;
 
-			px = FRAME_MARGIN_X;
-			frame_ptr = &frame[py][px];
-			for (x = 0; x < GRID_X; x++) {
+			px = FRAME_MARGIN_X + win_x0 * CELL;
+			frame_ptr = frame_row(py) + px;
+			for (x = win_x0; x < (uint32_t)win_x1; x++) {
 				avg = ptr[x];
 
 				// loop unrolled for performance
@@ -573,6 +1473,13 @@ protected:
 
 	void add_edge(int x, int y)
 	{
+		// on long contours we only keep one point every "edge_stride"
+		if (edge_skip != 0) {
+			edge_skip--;
+			return;
+		}
+		edge_skip = edge_stride - 1;
+
 		if (edge_count >= MAX_EDGE_PTS)
 			return;
 
@@ -601,12 +1508,45 @@ protected:
 			process_edge_point(x, y);
 	}
 
+	// return the number of points visited by build_edge_points. This is an
+	// upper bound of the number of edge points, as interior points are
+	// visited but not added
+	int count_edge_points(void)
+	{
+		int y, count;
+
+		count = (last[y_start] - first[y_start] + 1) + (last[y_end] - first[y_end] + 1);
+
+		for (y = y_start + 1; y < y_end; y++) {
+			count += 2;
+			if (last[y-1] < last[y])
+				count += last[y] - last[y-1];
+			if (last[y+1] < last[y])
+				count += last[y] - last[y+1];
+			if (first[y+1] > first[y])
+				count += first[y+1] - first[y];
+			if (first[y-1] > first[y])
+				count += first[y-1] - first[y];
+		}
+		return count;
+	}
+
 	void build_edge_points(void)
 	{
 		int y;
 
 		edge_count = 0;
 
+		// if the contour doesn't fit in the edge buffer, sample it
+		// uniformly instead of dropping the end of it, which would
+		// remove one side of the aruco completely
+		edge_stride = (count_edge_points() + MAX_EDGE_PTS - 1) / MAX_EDGE_PTS;
+		if (edge_stride > 1)
+			edges_decimated++;
+		else
+			edge_stride = 1;
+		edge_skip = 0;
+
 		process_edge_segment_fwd(first[y_start], last[y_start], y_start);
 
 		for (y = y_start + 1; y < y_end; y++) {
@@ -690,111 +1630,349 @@ protected:
 	}
 
 
-	void rotate_corners(aruco_t *a, int rotation) {
+	void rotate_corners(candidate_t *a, int rotation) {
 		if (rotation == 0)
 			return;
-		pt2d_t tmp[4];
+		point_t tmp[4];
 		memcpy(tmp, a->pt, sizeof(tmp));
 		for (int e = 0; e < 4; e++)
 			a->pt[e] = tmp[(e + 4 - rotation) & 3];
 	}
 
-	bool search_and_rotate(aruco_t *a, uint8_t *bmp)
+	bool search_and_rotate(candidate_t *a, int d, uint64_t code)
 	{
-		for (int i = 0; i < ARUCO_DB_SIZE; i++) {
-			for (int j = 0; j < 4; j++) {
-				if (memcmp(bmp, database[i][j], DB_BYTES) == 0) {
-					a->aruco_idx = i;
-					rotate_corners(a, j);
-					return true;
-				}
-			}
-		}
-		return false;
+		const aruco_dictionary_t *dict = dictionaries[d];
+		int entry = dict->find(code);
+
+		// the exact lookup is much cheaper, so only search the nearest
+		// entry if it fails
+		cand_hamming = 0;
+		if (entry < 0 && MAX_HAMMING > 0)
+			entry = dict->find_nearest(code, MAX_HAMMING, cand_hamming);
+		if (entry < 0)
+			return false;
+		a->aruco_idx = entry >> 2;
+		if (!is_allowed(d, a->aruco_idx))
+			return false;
+		a->dictionary = d;
+		cand_rotation = entry & 3;
+		rotate_corners(a, cand_rotation);
+		return true;
 	}
 
 	int mono_frame_pixel(uint32_t x, uint32_t y) {
 		x -= FRAME_MARGIN_X;
-		if (x >= USABLE_WIDTH)
+		if (x >= (uint32_t)USABLE_WIDTH)
 			return 0;
 		y -= FRAME_MARGIN_Y;
-		if (y >= USABLE_HEIGHT)
+		if (y >= (uint32_t)USABLE_HEIGHT)
 			return 0;
-		return frame[y + FRAME_MARGIN_Y][x + FRAME_MARGIN_X] > lc_grid[y / CELL][x / CELL];
+		return frame_row(y + FRAME_MARGIN_Y)[x + FRAME_MARGIN_X] > lc_grid[y / CELL][x / CELL];
 	}
 
-	// use the corner points to sample the aruco bits and identify it.
-	// Rotate the corners so that pt[0] is always the top left corner of the
-	// aruco and the other corners are sorted clockwise (pt[1] is top right,
-	// etc.)
-	bool identify_and_rotate(aruco_t *a) {
-		pt2d_t vec[2], e[2], v, p;
-		int i, j, ix, iy;
-		int b, bit, b_idx, sample;
-		uint8_t bmp[DB_BYTES];
-
-		vec[0] = (a->pt[3] - a->pt[0]) * (1.0f / (TOTAL_BITS * 2));
-		vec[1] = (a->pt[2] - a->pt[1]) * (1.0f / (TOTAL_BITS * 2));
-
-		bit = 128;
-		b_idx = 0;
-		b = 0;
-		for (i = 0; i < TOTAL_BITS; i++) {
-			e[0] = a->pt[0] + vec[0] * (i * 2 + 1);
-			e[1] = a->pt[1] + vec[1] * (i * 2 + 1);
-
-			v = (e[1] - e[0]) * (1.0f / (TOTAL_BITS * 2));
-			for (j = 0; j < TOTAL_BITS; j++) {
-				p = e[0] + v * (j * 2 + 1);
-
-				ix = p.x;
-				if (ix < 0 || ix >= FRAME_WIDTH)
+	void update_margin(int margin) {
+		if (margin < cand_margin)
+			cand_margin = margin;
+	}
+
+	// difference between a pixel and its threshold, for the quality metrics
+	int mono_frame_margin(uint32_t x, uint32_t y) {
+		x -= FRAME_MARGIN_X;
+		if (x >= (uint32_t)USABLE_WIDTH)
+			return 0;
+		y -= FRAME_MARGIN_Y;
+		if (y >= (uint32_t)USABLE_HEIGHT)
+			return 0;
+		return abs(frame_row(y + FRAME_MARGIN_Y)[x + FRAME_MARGIN_X] - lc_grid[y / CELL][x / CELL]);
+	}
+
+	// compute the homography that maps the unit square to the aruco
+	// corners, with u along pt0 -> pt1 and v along pt0 -> pt3:
+	// x = (h0*u + h1*v + h2) / w, y = (h3*u + h4*v + h5) / w,
+	// w = h6*u + h7*v + 1
+	bool compute_homography(const candidate_t *a, scalar_t hom[8])
+	{
+		typedef geom_traits<scalar_t> gt;
+		const point_t *q = a->pt;
+		typename gt::accum_t det;
+
+		scalar_t dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+		scalar_t dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+		scalar_t sx = q[0].x - q[1].x + q[2].x - q[3].x;
+		scalar_t sy = q[0].y - q[1].y + q[2].y - q[3].y;
+
+		det = gt::accum_mul(dx1, dy2) - gt::accum_mul(dx2, dy1);
+		if (det == 0)
+			return false;
+
+		hom[6] = gt::accum_div(gt::accum_mul(sx, dy2) - gt::accum_mul(dx2, sy), det);
+		hom[7] = gt::accum_div(gt::accum_mul(dx1, sy) - gt::accum_mul(sx, dy1), det);
+
+		// w is linear in u and v, so if it is positive on the 4 corners
+		// it is positive on the whole aruco
+		if (hom[6] <= scalar_t(-1) || hom[7] <= scalar_t(-1) || hom[6] + hom[7] <= scalar_t(-1))
+			return false;
+
+		hom[0] = q[1].x - q[0].x + hom[6] * q[1].x;
+		hom[1] = q[3].x - q[0].x + hom[7] * q[3].x;
+		hom[2] = q[0].x;
+		hom[3] = q[1].y - q[0].y + hom[6] * q[1].y;
+		hom[4] = q[3].y - q[0].y + hom[7] * q[3].y;
+		hom[5] = q[0].y;
+		return true;
+	}
+
+	// read the bits from the grayscale image: average BIT_SAMPLES x
+	// BIT_SAMPLES samples over the center of each cell and compare them to
+	// a threshold half way between the black level, interpolated from the
+	// border cells of the same row and column, and the white level of the
+	// brightest interior cells
+	bool read_bits_gray(candidate_t *a, const scalar_t hom[8], const grid_t &g, uint64_t &res)
+	{
+		typedef geom_traits<scalar_t> gt;
+		int cell[MAX_TOTAL_BITS][MAX_TOTAL_BITS];
+		int i, j, k, m, black, white, count, level, contrast;
+		int32_t px, py;
+		scalar_t x, y, w, dx, dy, dw, u, v, r;
+		uint64_t code;
+
+		// all the samples are inside the aruco, so if the corners can
+		// be sampled, so can the cells. With distortion, each sample is
+		// checked instead
+		if (UNDISTORT != ARUCO_UNDISTORT_BITS)
+			for (i = 0; i < 4; i++)
+				if (!inside_frame(a->pt[i]))
 					return false;
-				iy = p.y;
-				if (iy < 0 || iy >= FRAME_HEIGHT)
+
+		const int total = g.total;
+		const scalar_t step = g.step;
+		const scalar_t first = g.first;
+		const scalar_t spacing = g.spacing;
+		const int last = total - 1;
+
+		dx = hom[0] * step;
+		dy = hom[3] * step;
+		dw = hom[6] * step;
+
+		memset(cell, 0, sizeof(cell));
+		for (i = 0; i < total; i++) {
+			for (m = 0; m < BIT_SAMPLES; m++) {
+				v = scalar_t(i) * step + scalar_t(m) * spacing + first;
+				for (k = 0; k < BIT_SAMPLES; k++) {
+					// the same sample of every cell in the row
+					u = scalar_t(k) * spacing + first;
+					x = hom[0] * u + hom[1] * v + hom[2];
+					y = hom[3] * u + hom[4] * v + hom[5];
+					w = hom[6] * u + hom[7] * v + scalar_t(1);
+					for (j = 0; j < total; j++) {
+						r = scalar_t(1) / w;
+						px = gt::to_raw16(x * r);
+						py = gt::to_raw16(y * r);
+						if (UNDISTORT == ARUCO_UNDISTORT_BITS) {
+							undistort.distort_raw16(px, py);
+							if (!inside_frame_raw16(px, py))
+								return false;
+						}
+						cell[i][j] += frame_sample(px, py);
+						debug_plot(px >> 16, py >> 16, ADP_MARKER_COLOR);
+						x += dx;
+						y += dy;
+						w += dw;
+					}
+				}
+			}
+		}
+
+		// the black level is the average of the outer ring of cells, the
+		// white level the average of the interior cells that are closer
+		// to the brightest one than to the black level
+		black = 0;
+		for (i = 0; i < last; i++)
+			black += cell[0][i] + cell[i][last] + cell[last][i + 1] + cell[i + 1][0];
+		black /= last * 4;
+
+		level = black;
+		for (i = ARUCO_BORDER; i < total - ARUCO_BORDER; i++)
+			for (j = ARUCO_BORDER; j < total - ARUCO_BORDER; j++)
+				if (cell[i][j] > level)
+					level = cell[i][j];
+		level = (black + level) / 2;
+
+		white = 0;
+		count = 0;
+		for (i = ARUCO_BORDER; i < total - ARUCO_BORDER; i++)
+			for (j = ARUCO_BORDER; j < total - ARUCO_BORDER; j++)
+				if (cell[i][j] > level) {
+					white += cell[i][j];
+					count++;
+				}
+
+		contrast = BIT_MIN_CONTRAST * BIT_CELL_SCALE;
+		if (count == 0 || white / count - black < contrast)
+			return false;
+		white /= count;
+
+		// the whole border must be black
+		level = (black + white) / 2;
+		for (i = 0; i < total; i++) {
+			for (j = 0; j < total; j++) {
+				if (i >= ARUCO_BORDER && i < (total - ARUCO_BORDER) &&
+				    j >= ARUCO_BORDER && j < (total - ARUCO_BORDER))
+					continue;
+				if (cell[i][j] >= level)
 					return false;
+				if (QUALITY)
+					update_margin((level - cell[i][j]) / BIT_CELL_SCALE);
+			}
+		}
 
-				sample = mono_frame_pixel(ix, iy);
+		code = 0;
+		for (i = ARUCO_BORDER; i < total - ARUCO_BORDER; i++) {
+			for (j = ARUCO_BORDER; j < total - ARUCO_BORDER; j++) {
+				// black level for this cell, interpolated between
+				// the border cells of its row and of its column
+				level = ((last - j) * cell[i][0] + j * cell[i][last] +
+					 (last - i) * cell[0][j] + i * cell[last][j]) / (last * 2);
+				code = (code << 1) | (cell[i][j] * 2 >= level + white);
+				if (QUALITY)
+					update_margin(abs(cell[i][j] * 2 - level - white) / (2 * BIT_CELL_SCALE));
+			}
+		}
 
-				if (i < ARUCO_BORDER || i >= (TOTAL_BITS - ARUCO_BORDER) ||
-				    j < ARUCO_BORDER || j >= (TOTAL_BITS - ARUCO_BORDER)) {
+		res = code;
+		return true;
+	}
+
+	// read the bits from the thresholded image, one pixel per cell. The
+	// cells are sampled at the positions given by the homography of the
+	// aruco corners, so that the sampling is correct under perspective. The
+	// cell centers of each row are generated by stepping the homogeneous
+	// coordinates, which only costs a division per cell
+	bool read_bits(const scalar_t hom[8], const grid_t &g, uint64_t &res)
+	{
+		typedef geom_traits<scalar_t> gt;
+		scalar_t x, y, w, dx, dy, dw, v, r;
+		int i, j, ix[MAX_TOTAL_BITS], iy[MAX_TOTAL_BITS];
+		int32_t px, py;
+		int sample;
+		uint64_t code;
+
+		const int total = g.total;
+		const scalar_t step = g.step;
+		const scalar_t half = g.half;
+
+		dx = hom[0] * step;
+		dy = hom[3] * step;
+		dw = hom[6] * step;
+
+		code = 0;
+		for (i = 0; i < total; i++) {
+			v = scalar_t(i * 2 + 1) * half;
+			x = hom[0] * half + hom[1] * v + hom[2];
+			y = hom[3] * half + hom[4] * v + hom[5];
+			w = hom[6] * half + hom[7] * v + scalar_t(1);
+
+			// project the whole row first: this loop has no branches
+			for (j = 0; j < total; j++) {
+				r = scalar_t(1) / w;
+				if (UNDISTORT == ARUCO_UNDISTORT_BITS) {
+					px = gt::to_raw16(x * r);
+					py = gt::to_raw16(y * r);
+					undistort.distort_raw16(px, py);
+					ix[j] = px >> 16;
+					iy[j] = py >> 16;
+				} else {
+					ix[j] = (int)(x * r);
+					iy[j] = (int)(y * r);
+				}
+				x += dx;
+				y += dy;
+				w += dw;
+			}
+
+			for (j = 0; j < total; j++) {
+				if (ix[j] < 0 || ix[j] >= FRAME_WIDTH)
+					return false;
+				if (iy[j] < 0 || iy[j] >= FRAME_HEIGHT)
+					return false;
+
+				sample = mono_frame_pixel(ix[j], iy[j]);
+				if (QUALITY)
+					update_margin(mono_frame_margin(ix[j], iy[j]));
+
+				if (i < ARUCO_BORDER || i >= (total - ARUCO_BORDER) ||
+				    j < ARUCO_BORDER || j >= (total - ARUCO_BORDER)) {
 					if (sample != 0) {
-						debug_plot(ix, iy, ADP_RED);
+						debug_plot(ix[j], iy[j], ADP_RED);
 						return false;
 					}
-					debug_plot(ix, iy, ADP_MARKER_COLOR);
+					debug_plot(ix[j], iy[j], ADP_MARKER_COLOR);
 				} else {
-					debug_plot(ix, iy, ADP_MARKER_COLOR);
-					if (sample)
-						b |= bit;
-					bit >>= 1;
-					if (bit == 0) {
-						bit = 128;
-						bmp[b_idx] = b;
-						b_idx++;
-						b = 0;
-					}
+					debug_plot(ix[j], iy[j], ADP_MARKER_COLOR);
+					code = (code << 1) | (sample != 0);
 				}
 			}
 		}
 
-		const int reminder = ((ARUCO_BITS * ARUCO_BITS) & 7);
-		if (reminder != 0) {
-			b >>= (8 - reminder);
-			bmp[b_idx] = b;
-		}
+		res = code;
+		return true;
+	}
 
-		return search_and_rotate(a, bmp);
+	// use the corner points to sample the aruco bits and identify it.
+	// Rotate the corners so that pt[0] is always the top left corner of the
+	// aruco and the other corners are sorted clockwise (pt[1] is top right,
+	// etc.). The bits are read once for each grid size, and looked up on
+	// all the dictionaries of that size. The largest grids are tried first:
+	// their codes are much sparser, so the bits of a small aruco are very
+	// unlikely to match one of them, while the bits of a large aruco read
+	// with a small grid often match some code of a dense dictionary
+	bool identify_and_rotate(candidate_t *a) {
+		scalar_t hom[8];
+		uint64_t code;
+		int d, i, total;
+
+		if (!compute_homography(a, hom))
+			return false;
+
+		for (total = MAX_TOTAL_BITS; total > ARUCO_BORDER * 2; total--) {
+			if ((grid_totals & (1 << total)) == 0)
+				continue;
+			for (d = 0; grid[d].total != total; d++)
+				;
+
+			if (QUALITY)
+				cand_margin = 255;
+			if (BIT_SAMPLES > 0) {
+				if (!read_bits_gray(a, hom, grid[d], code))
+					continue;
+			} else {
+				if (!read_bits(hom, grid[d], code))
+					continue;
+			}
+
+			for (i = d; i < dictionary_count; i++)
+				if (grid[i].total == total && search_and_rotate(a, i, code))
+					return true;
+		}
+		return false;
 	}
 
 
-	int compute_aruco_points(void)
+	// weight of an edge point for the robust fit, based on its distance to
+	// the line of the previous iteration
+	scalar_t robust_weight(const line_t &line, scalar_t px, scalar_t py)
 	{
-		int i, e, b, total, i1, i2, b0, b1, bucks[4];
-		line_fit_t fit;
-		line2d_t line[4];
-		pt2d_t center;
-		aruco_t a;
+		return huber_weight((point_t(px, py) - line.c).cross(line.v), scalar_t(ROBUST_DELTA));
+	}
+
+	// histogram quad finder: group the edge points by direction and fit a
+	// line to each of the 4 dominant directions
+	bool fit_sides_histogram(line_t line[4])
+	{
+		int i, e, iter, total, i1, i2, b0, b1, bucks[4];
+		int8_t bucket_side[32];
+		scalar_t fx, fy;
+		fit_t fit[4];
 
 		memset(edge_bucket, 0, sizeof(edge_bucket));
 
@@ -826,7 +2004,7 @@ protected:
 		// from the corner area are still considered to be part of the edge, so
 		// if we have less points than the minimum, it is probably not an aruco
 		if (total < edge_count - (ANGLE_DELTA * 2 + 1) * 4)
-			return 0;
+			return false;
 
 		// sort the edges by angle, so that we get the edges in counter
 		// clockwise mode
@@ -838,23 +2016,354 @@ protected:
 
 		//printf("bucks %d %d %d %d\n", bucks[0], bucks[1], bucks[2], bucks[3]);
 
-		// compute segments
-		for (e = 0; e < 4; e++) {
-			b = bucks[e];
-			fit.reset();
+		// map each bucket to the side it was selected for (or -1). The
+		// selected buckets are never neighbors, so a point can only
+		// contribute to one side through its even bucket and to one
+		// side through its odd bucket
+		memset(bucket_side, -1, sizeof(bucket_side));
+		for (e = 0; e < 4; e++)
+			bucket_side[bucks[e]] = e;
+
+		// accumulate all 4 sides in a single pass over the edge points.
+		// The first pass is a plain least squares fit, the following
+		// ones (if any) reweight the same points by their distance to
+		// the previous fit
+		for (iter = 0; iter <= ROBUST_ITERATIONS; iter++) {
+			for (e = 0; e < 4; e++)
+				fit[e].reset();
+
 			for (i = 0; i < edge_count; i++) {
-				b0 = (edge_angle[i] / 16) * 2;
-				b1 = (((edge_angle[i] + 8) / 16) * 2 + 31) & 31;
-				if (b0 != b && b1 != b)
+				b0 = bucket_side[(edge_angle[i] / 16) * 2];
+				b1 = bucket_side[(((edge_angle[i] + 8) / 16) * 2 + 31) & 31];
+				if (b0 < 0 && b1 < 0)
 					continue;
-				fit.add(edge[i][0] + 0.5, edge[i][1] + 0.5);
-				debug_plot(edge[i][0], edge[i][1], ADP_EDGE_PT_COLOR);
+				fx = scalar_t(edge[i][0]) + scalar_t(0.5f);
+				fy = scalar_t(edge[i][1]) + scalar_t(0.5f);
+				if (iter == 0) {
+					if (b0 >= 0)
+						fit[b0].add(fx, fy);
+					if (b1 >= 0)
+						fit[b1].add(fx, fy);
+					debug_plot(edge[i][0], edge[i][1], ADP_EDGE_PT_COLOR);
+				} else {
+					if (b0 >= 0)
+						fit[b0].add(fx, fy, robust_weight(line[b0], fx, fy));
+					if (b1 >= 0)
+						fit[b1].add(fx, fy, robust_weight(line[b1], fx, fy));
+				}
 			}
+
 			// compute linear regression
-			fit.compute(line[e]);
+			for (e = 0; e < 4; e++) {
+				if (!fit[e].compute(line[e]))
+					return false;
+
+				//printf("segment %f %f %f %f\n", line[e].c.x, line[e].c.y, line[e].v.x, line[e].v.y);
+				//draw_marker(line[e].x, line[e].y);
+			}
+		}
+
+		if (QUALITY)
+			for (e = 0; e < 4; e++)
+				cand_residual[e] = fit[e].residual(line[e]);
+
+		return true;
+	}
+
+	int edge_dist2(int i1, int i2)
+	{
+		int dx = edge[i1][0] - edge[i2][0];
+		int dy = edge[i1][1] - edge[i2][1];
+		return dx * dx + dy * dy;
+	}
+
+	int farthest_edge_point(int from)
+	{
+		int i, d, max = -1, max_idx = 0;
+
+		for (i = 0; i < edge_count; i++) {
+			d = edge_dist2(from, i);
+			if (d > max) {
+				max = d;
+				max_idx = i;
+			}
+		}
+		return max_idx;
+	}
+
+	// polygon quad finder: find the 4 corners directly on the (ordered)
+	// contour by maximal distance splitting, like the first steps of a
+	// Douglas-Peucker approximation, and fit a line to the interior of each
+	// side. This skips the angle histogram completely, but it is less
+	// tolerant to noisy contours
+	bool fit_sides_polygon(line_t line[4])
+	{
+		int i, s, k, n, idx, margin, c, cmin, cmax, len2, tol, dx, dy;
+		int corner[4], arc, iter;
+		scalar_t fx, fy;
+		fit_t fit;
+
+		// the farthest point from any contour point is a corner and the
+		// farthest point from that corner is the opposite corner
+		corner[0] = farthest_edge_point(0);
+		corner[2] = farthest_edge_point(corner[0]);
+
+		// the other 2 corners are the points farthest away from the
+		// diagonal, one on each side of it
+		dx = edge[corner[2]][0] - edge[corner[0]][0];
+		dy = edge[corner[2]][1] - edge[corner[0]][1];
+		cmin = 0;
+		cmax = 0;
+		corner[1] = corner[0];
+		corner[3] = corner[0];
+		for (i = 0; i < edge_count; i++) {
+			c = dx * (edge[i][1] - edge[corner[0]][1]) - dy * (edge[i][0] - edge[corner[0]][0]);
+			if (c > cmax) {
+				cmax = c;
+				corner[1] = i;
+			}
+			if (c < cmin) {
+				cmin = c;
+				corner[3] = i;
+			}
+		}
+
+		// the cross product is the distance to the diagonal multiplied by
+		// its length: both corners must be at least 1/5 of the diagonal
+		// away from it, or this is too thin / triangular to be an aruco
+		len2 = dx * dx + dy * dy;
+		if (cmax * 5 < len2 || -cmin * 5 < len2) //PARAM
+			return false;
+
+		// the corners must alternate along the contour. Put them in
+		// contour order, which is the same counter clockwise order the
+		// histogram method produces
+		arc = edge_pt(corner[2] - corner[0]);
+		if ((edge_pt(corner[1] - corner[0]) < arc) == (edge_pt(corner[3] - corner[0]) < arc))
+			return false;
+		if (edge_pt(corner[1] - corner[0]) > arc) {
+			i = corner[1];
+			corner[1] = corner[3];
+			corner[3] = i;
+		}
+
+		for (s = 0; s < 4; s++) {
+			n = edge_pt(corner[(s + 1) & 3] - corner[s]);
+
+			// skip the points close to the corners, where the contour
+			// is already bending to the next side
+			margin = ANGLE_DELTA + n / 16; //PARAM
+			if (n - margin * 2 < 2)
+				return false;
+
+			dx = edge[corner[(s + 1) & 3]][0] - edge[corner[s]][0];
+			dy = edge[corner[(s + 1) & 3]][1] - edge[corner[s]][1];
+			len2 = dx * dx + dy * dy;
+
+			// maximum distance of a side point to the chord is
+			// 2 pixels + 1/10 of the side length, scaled by the
+			// length like the cross product is
+			tol = 2 * isqrt64(len2) + len2 / 10; //PARAM
+
+			fit.reset();
+			for (k = margin; k <= n - margin; k++) {
+				idx = edge_pt(corner[s] + k);
+
+				// if the side bulges away from the chord, the
+				// contour would need more than 4 vertices
+				c = dx * (edge[idx][1] - edge[corner[s]][1]) - dy * (edge[idx][0] - edge[corner[s]][0]);
+				if (abs(c) > tol)
+					return false;
+
+				fit.add(scalar_t(edge[idx][0]) + scalar_t(0.5f), scalar_t(edge[idx][1]) + scalar_t(0.5f));
+				debug_plot(edge[idx][0], edge[idx][1], ADP_EDGE_PT_COLOR);
+			}
+
+			if (!fit.compute(line[s]))
+				return false;
+
+			// reweight the same points for the robust fit
+			for (iter = 0; iter < ROBUST_ITERATIONS; iter++) {
+				fit.reset();
+				for (k = margin; k <= n - margin; k++) {
+					idx = edge_pt(corner[s] + k);
+					fx = scalar_t(edge[idx][0]) + scalar_t(0.5f);
+					fy = scalar_t(edge[idx][1]) + scalar_t(0.5f);
+					fit.add(fx, fy, robust_weight(line[s], fx, fy));
+				}
+				if (!fit.compute(line[s]))
+					return false;
+			}
+
+			if (QUALITY)
+				cand_residual[s] = fit.residual(line[s]);
+		}
+
+		return true;
+	}
+
+	// bilinear interpolation of the frame at (x,y), given in 16.16 fixed
+	// point. The result is the pixel value scaled by 256. The caller must
+	// make sure the 2x2 neighborhood is inside the frame
+	int frame_sample(int32_t x, int32_t y)
+	{
+		const uint8_t *ptr;
+		ptrdiff_t stride = row_stride();
+		int fx, fy, top, bottom;
+
+		// pixel centers are at .5 coordinates
+		x -= 0x8000;
+		y -= 0x8000;
+		fx = (x >> 8) & 0xFF;
+		fy = (y >> 8) & 0xFF;
+		ptr = frame_row(y >> 16) + (x >> 16);
+
+		top = ptr[0] * 256 + (ptr[1] - ptr[0]) * fx;
+		bottom = ptr[stride] * 256 + (ptr[stride + 1] - ptr[stride]) * fx;
+		return top + (((bottom - top) * fy) >> 8);
+	}
+
+	bool inside_frame_raw16(int32_t x, int32_t y)
+	{
+		return x >= 0x10000 && x < ((FRAME_WIDTH - 1) << 16) &&
+		       y >= 0x10000 && y < ((FRAME_HEIGHT - 1) << 16);
+	}
+
+	bool inside_frame(const point_t &p)
+	{
+		return p.x >= scalar_t(1) && p.x < scalar_t(FRAME_WIDTH - 1) &&
+		       p.y >= scalar_t(1) && p.y < scalar_t(FRAME_HEIGHT - 1);
+	}
 
-			//printf("segment %f %f %f %f\n", line[e].c.x, line[e].c.y, line[e].v.x, line[e].v.y);
-			//draw_marker(line[e].x, line[e].y);
+	// sample the grayscale profile across the side at "p", along the
+	// outwards normal "n", and find where it crosses the level half way
+	// between the dark aruco border and the bright background, with
+	// sub-pixel accuracy. Return false if the profile falls outside the
+	// frame or there is no clear edge
+	bool refine_edge_point(point_t p, point_t n, point_t &edge_point)
+	{
+		int profile[REFINE_POINTS], i, level;
+		int32_t x, y, dx, dy, offset;
+		point_t q;
+
+		q = p - n * scalar_t(REFINE_RANGE);
+		if (!inside_frame(q) || !inside_frame(p + n * scalar_t(REFINE_RANGE)))
+			return false;
+
+		x = geom_traits<scalar_t>::to_raw16(q.x);
+		y = geom_traits<scalar_t>::to_raw16(q.y);
+		dx = geom_traits<scalar_t>::to_raw16(n.x) / REFINE_STEPS;
+		dy = geom_traits<scalar_t>::to_raw16(n.y) / REFINE_STEPS;
+		for (i = 0; i < REFINE_POINTS; i++) {
+			profile[i] = frame_sample(x, y);
+			x += dx;
+			y += dy;
+		}
+
+		// the ends of the profile should be well inside the dark border
+		// and the bright background
+		if (profile[REFINE_POINTS - 1] - profile[0] < REFINE_MIN_CONTRAST * 256)
+			return false;
+		level = (profile[0] + profile[REFINE_POINTS - 1]) / 2;
+
+		for (i = 1; i < REFINE_POINTS; i++)
+			if (profile[i] >= level)
+				break;
+
+		// position of the crossing along the profile, in 16.16
+		offset = (i - 1) * 65536 + (((level - profile[i - 1]) << 8) / (profile[i] - profile[i - 1]) << 8);
+		edge_point = q + n * geom_traits<scalar_t>::from_raw16(offset / REFINE_STEPS);
+		return true;
+	}
+
+	// refine each side by locating the edge on the grayscale image at a few
+	// positions along the side and fitting a new line to those positions.
+	// The line "v" vectors must already point in the consistent direction
+	// used to move them outwards
+	void refine_sides(line_t line[4], candidate_t &a)
+	{
+		int e, k, count;
+		fit_t fit;
+		line_t refined;
+		point_t p, n, edge_point, points[REFINE_SAMPLES > 0 ? REFINE_SAMPLES : 1];
+		scalar_t t, d, sum;
+
+		for (e = 0; e < 4; e++) {
+			n = point_t(line[e].v.y, -line[e].v.x);
+			fit.reset();
+
+			// the side goes from the previous corner to this corner.
+			// Stay away from the corners, where the gradient is
+			// affected by the other side
+			t = scalar_t(0.2f + REFINE_SPACING * 0.5f);
+			count = 0;
+			for (k = 0; k < REFINE_SAMPLES; k++) {
+				p = a.pt[(e + 3) & 3] + (a.pt[e] - a.pt[(e + 3) & 3]) * t;
+				t += scalar_t(REFINE_SPACING);
+				if (refine_edge_point(p, n, edge_point)) {
+					fit.add(edge_point.x, edge_point.y);
+					points[count++] = edge_point;
+					debug_plot((int)edge_point.x, (int)edge_point.y, ADP_YELLOW);
+				}
+			}
+
+			if (!fit.compute(refined))
+				continue;
+			line[e] = refined;
+
+			// there are only a few refined points, so their residual
+			// is computed directly, which doesn't lose precision to
+			// the sums far from the origin
+			if (QUALITY) {
+				sum = scalar_t(0);
+				for (k = 0; k < count; k++) {
+					d = refined.v.cross(points[k] - refined.c);
+					sum += d * d;
+				}
+				cand_residual[e] = sum / scalar_t(count);
+			}
+		}
+	}
+
+	void store_quality(const aruco_t &a, aruco_quality_t &q)
+	{
+		float area = 0, residual = 0;
+
+		for (int e = 0; e < 4; e++) {
+			area += a.pt[e].cross(a.pt[(e + 1) & 3]);
+			residual += float(cand_residual[e]);
+		}
+
+		q.fit_residual = sqrtf(residual * 0.25f);
+		q.bit_margin = cand_margin;
+		q.hamming = cand_hamming;
+		q.size = sqrtf(fabsf(area) * 0.5f);
+	}
+
+	int compute_aruco_points(void)
+	{
+		int e, track;
+		line_t line[4];
+		point_t center, raw[4];
+		candidate_t a;
+
+		if (QUALITY)
+			for (e = 0; e < 4; e++)
+				cand_residual[e] = scalar_t(0);
+		cand_margin = 255;
+		cand_hamming = 0;
+		cand_rotation = 0;
+
+		if (QUAD_FINDER == ARUCO_QUAD_POLYGON) {
+			if (!fit_sides_polygon(line)) {
+				rejects.quad++;
+				return 0;
+			}
+		} else {
+			if (!fit_sides_histogram(line)) {
+				rejects.quad++;
+				return 0;
+			}
 		}
 
 		// we need to move the segments 0.5 pixels outwards, to compensate for
@@ -862,47 +2371,127 @@ protected:
 		// the aruco
 
 		// find an interior point (we select the center of the segment centers)
-		center = pt2d_t(0, 0);
+		center = point_t(scalar_t(0), scalar_t(0));
 		for (e = 0; e < 4; e++)
 			center += line[e].c;
-		center *= 0.25;
+		center *= scalar_t(0.25f);
 
 		// make the "v" vector point in a consistent direction relative to the
 		// center -> segment center vector and use it to move the center outwards
 		for (e = 0; e < 4; e++) {
-			if (line[e].v.cross(line[e].c - center) > 0)
+			if (line[e].v.cross(line[e].c - center) > scalar_t(0))
 				line[e].v = -line[e].v;
 			// move the line outwards by half a pixel
-			line[e].c += pt2d_t(line[e].v.y, -line[e].v.x) * 0.5;
+			line[e].c += point_t(line[e].v.y, -line[e].v.x) * scalar_t(0.5f);
 		}
 
 		// now we have all the segments we can intersect them
-		for (e = 0; e < 4; e++)
-			if (intersect_lines(line[e], line[(e + 1) & 3], a.pt[e]) == 0)
+		for (e = 0; e < 4; e++) {
+			if (intersect_lines(line[e], line[(e + 1) & 3], a.pt[e]) == 0) {
+				rejects.quad++;
 				return 0;
+			}
+		}
+
+		if (REFINE_SAMPLES > 0) {
+			refine_sides(line, a);
+			for (e = 0; e < 4; e++) {
+				if (intersect_lines(line[e], line[(e + 1) & 3], a.pt[e]) == 0) {
+					rejects.quad++;
+					return 0;
+				}
+			}
+		}
+
+		// an aruco found where a tracked one was predicted keeps its id
+		track = -1;
+		memcpy(raw, a.pt, sizeof(raw));
+		if (TRACKING && !discovery)
+			track = match_track(a);
+		if (QUALITY && track >= 0) {
+			cand_margin = aruco_quality_t::NOT_READ;
+			cand_hamming = aruco_quality_t::NOT_READ;
+		}
+
+		// the bits are read with the homography of the undistorted corners
+		if (UNDISTORT == ARUCO_UNDISTORT_BITS)
+			for (e = 0; e < 4; e++)
+				a.pt[e] = undistort.undistort(a.pt[e]);
 
-		if (!identify_and_rotate(&a))
+		if (track < 0 && !identify_and_rotate(&a)) {
+			rejects.decode++;
 			return 0;
+		}
+
+		if (UNDISTORT == ARUCO_UNDISTORT_CORNERS)
+			for (e = 0; e < 4; e++)
+				a.pt[e] = undistort.undistort(a.pt[e]);
 
 		// printf("found aruco %d\n", a.aruco_idx);
 		// for (e = 0; e < 4; e++)
 		// 	printf("   corner %d: %g, %g\n", e, a.pt[e].x, a.pt[e].y);
 
+		// store result in result / arucos_found
+		for (e = 0; e < 4; e++)
+			result[arucos_found].pt[e] = pt2d_t(a.pt[e]);
+		result[arucos_found].aruco_idx = a.aruco_idx;
+		result[arucos_found].dictionary = a.dictionary;
+		if (QUALITY)
+			store_quality(result[arucos_found], quality[arucos_found]);
+		if (stop_when_all_found && !already_found(a.dictionary, a.aruco_idx, arucos_found))
+			allowed_found++;
+		if (TRACKING) {
+			track_t &t = found[arucos_found];
+			for (e = 0; e < 4; e++)
+				t.last[e] = pt2d_t(raw[(e + 4 - cand_rotation) & 3]);
+			t.aruco_idx = a.aruco_idx;
+			t.dictionary = a.dictionary;
+			t.match = track;
+		}
+		if (INCREMENTAL) {
+			pt2d_t p[4];
+			for (e = 0; e < 4; e++)
+				p[e] = pt2d_t(raw[e]);
+			corners_window(p, CELL, 0, footprint[arucos_found]);
+		}
+		store_box(raw, result_box[arucos_found]);
+
 		for (e = 0; e < 4; e++)
-			debug_draw_marker(a.pt[e].x, a.pt[e].y, e + 1);
+			debug_draw_marker(result[arucos_found].pt[e].x, result[arucos_found].pt[e].y, e + 1);
 
-		// store result in result / arucos_found
-		result[arucos_found] = a;
 		arucos_found++;
 
 		return 1;
 	}
 
 
+	// store the bounding box of the corners of a result on the frame
+	static void store_box(const point_t pt[4], int16_t box[4])
+	{
+		float min_x, min_y, max_x, max_y;
+		int e;
+
+		min_x = max_x = float(pt[0].x);
+		min_y = max_y = float(pt[0].y);
+		for (e = 1; e < 4; e++) {
+			min_x = fminf(min_x, float(pt[e].x));
+			min_y = fminf(min_y, float(pt[e].y));
+			max_x = fmaxf(max_x, float(pt[e].x));
+			max_y = fmaxf(max_y, float(pt[e].y));
+		}
+		box[0] = floorf(min_x);
+		box[1] = floorf(min_y);
+		box[2] = ceilf(max_x);
+		box[3] = ceilf(max_y);
+	}
+
 	int process_aruco(int idx)
 	{
 		segment_t *seg;
-		int i, seg_idx, f, l, y;
+		int i, seg_idx, f, l, y, len, x0, y0, dx, dy, sx_seg;
+		int min_x, max_x, area, envelope, bbox;
+		int64_t sx, sy, sxx, syy, sxy;
+		float mx, my, cxx, cyy, cxy, t, d;
 
 		if (arucos_found >= MAX_ARUCO_COUNT)
 			return 0;
@@ -910,16 +2499,27 @@ protected:
 		y_start = FRAME_HEIGHT;
 		y_end = -1;
 
-		memset(first, 0x10, sizeof(first));
-		memset(last, 0xFF, sizeof(last));
+		memset(first, 0x10, FRAME_HEIGHT * sizeof(first[0]));
+		memset(last, 0xFF, FRAME_HEIGHT * sizeof(last[0]));
 
+		// while building the borders, also accumulate the area, bounding
+		// box and moments of the dark area, relative to the first segment
+		// to keep the numbers small
 		seg_idx = arucos[idx];
+		x0 = segments[seg_idx].start;
+		y0 = segments[seg_idx].y;
+		min_x = FRAME_WIDTH;
+		max_x = -1;
+		area = 0;
+		sx = sy = sxx = syy = sxy = 0;
+
 		while (seg_idx != -1) {
 			seg = &segments[seg_idx];
 			seg_idx = seg->next;
 
 			f = seg->start;
-			l = seg->start + seg->length - 1;
+			len = seg->length;
+			l = f + len - 1;
 			y = seg->y;
 
 			if (y < y_start) y_start = y;
@@ -927,35 +2527,92 @@ protected:
 
 			if (f < first[y]) first[y] = f;
 			if (l > last[y]) last[y] = l;
+
+			if (f < min_x) min_x = f;
+			if (l > max_x) max_x = l;
+
+			// closed form sums of x and x^2 over the segment pixels
+			dx = f - x0;
+			dy = y - y0;
+			sx_seg = len * dx + len * (len - 1) / 2;
+			area += len;
+			sx += sx_seg;
+			sy += len * dy;
+			sxx += len * dx * dx + dx * len * (len - 1) + (len - 1) * len * (2 * len - 1) / 6;
+			syy += len * dy * dy;
+			sxy += dy * sx_seg;
 		}
 
 		// if the blob touches the border, we can't use it, or we'll risk having
 		// one side of an aruco distorted by the frame border
-		if (y_start <= FRAME_MARGIN_Y)
+		if (y_start <= FRAME_MARGIN_Y + win_y0 * CELL ||
+		    y_end >= FRAME_MARGIN_Y + win_y1 * CELL - 1) {
+			rejects.border++;
 			return 0;
-		if (y_end >= FRAME_HEIGHT - FRAME_MARGIN_Y - 1)
+		}
+		// or cut by a side of the window inside the frame
+		if ((win_x0 > 0 && min_x <= FRAME_MARGIN_X + win_x0 * CELL) ||
+		    (win_x1 < GRID_X && max_x >= FRAME_MARGIN_X + win_x1 * CELL - 1)) {
+			rejects.border++;
 			return 0;
+		}
 
-		// this is too small for an aruco
-		if (y_end - y_start < 15) //PARAM
+		// this is too small or too large for an aruco
+		if (y_end - y_start < filter.min_size || y_end - y_start > filter.max_size ||
+		    max_x - min_x < filter.min_size || max_x - min_x > filter.max_size) {
+			rejects.size++;
 			return 0;
+		}
 
 		// if there are sudden jumps at the border, it's not an aruco
 		for (i = y_start + 5; i < y_end - 5; i++) {
-			if (abs(first[i] - first[i+1]) > 50)	//PARAM
-				return 0;
-			if (abs(last[i] - last[i+1]) > 50)	//PARAM
+			if (abs(first[i] - first[i+1]) > filter.max_jump ||
+			    abs(last[i] - last[i+1]) > filter.max_jump) {
+				rejects.jump++;
 				return 0;
+			}
 		}
 
 		// if it's too thin, it's not a good aruco
 		f = 0;
+		envelope = 0;
 		for (i = y_start; i <= y_end; i++) {
 			l = last[i] - first[i];
 			if (l > f) f = l;
+			envelope += l + 1;
 		}
-		if (f < 15) //PARAM
+		if (f < filter.min_size) {
+			rejects.size++;
 			return 0;
+		}
+
+		// the dark area must fill a reasonable part of the bounding box
+		bbox = (max_x - min_x + 1) * (y_end - y_start + 1);
+		if (area < filter.min_fill * bbox) {
+			rejects.fill++;
+			return 0;
+		}
+
+		// the area between the borders of a convex shape is always at
+		// least half of its bounding box
+		if (envelope < filter.min_convexity * bbox) {
+			rejects.convexity++;
+			return 0;
+		}
+
+		// the eigenvalues of the covariance matrix are the squares of the
+		// principal axes of the dark area
+		mx = (float)sx / area;
+		my = (float)sy / area;
+		cxx = (float)sxx / area - mx * mx;
+		cyy = (float)syy / area - my * my;
+		cxy = (float)sxy / area - mx * my;
+		t = (cxx + cyy) * 0.5f;
+		d = sqrtf((cxx - cyy) * (cxx - cyy) * 0.25f + cxy * cxy);
+		if (t + d > filter.max_aspect * filter.max_aspect * (t - d)) {
+			rejects.aspect++;
+			return 0;
+		}
 
 		// now that we passed all the fast criteria, try to fit a 4 side polygon
 		// on the borders of the potential aruco
@@ -965,12 +2622,448 @@ protected:
 		return compute_aruco_points();
 	}
 
-	void process_finish(void)
+	// true if the aruco is one of the first "count" results
+	bool already_found(int dictionary, int aruco_idx, int count)
+	{
+		for (int i = 0; i < count; i++)
+			if (result[i].aruco_idx == aruco_idx && result[i].dictionary == dictionary)
+				return true;
+		return false;
+	}
+
+	bool is_allowed(int dictionary, int aruco_idx)
+	{
+		const uint32_t *ids = allowed[dictionary];
+		return ids == nullptr || (ids[aruco_idx >> 5] & (1u << (aruco_idx & 31))) != 0;
+	}
+
+	bool all_allowed_found(void)
+	{
+		int d, count = 0;
+
+		for (d = 0; d < dictionary_count; d++)
+			count += allowed_count[d];
+		return allowed_found >= count;
+	}
+
+	// find the tracked aruco predicted at the corners of "a", in any of
+	// their 4 rotations. If there is one, give its id to "a", rotate its
+	// corners as the tracked ones and return its index, or -1 otherwise
+	int match_track(candidate_t &a)
+	{
+		int i, e, r, matched;
+		float max_error2 = tracking.max_error * tracking.max_error;
+		pt2d_t p[4];
+
+		for (e = 0; e < 4; e++)
+			p[e] = pt2d_t(a.pt[e]);
+
+		for (i = 0; i < track_count; i++) {
+			// the allowed ids may have changed since it was found
+			if (!is_allowed(tracks[i].dictionary, tracks[i].aruco_idx))
+				continue;
+
+			for (r = 0; r < 4; r++) {
+				for (e = 0; e < 4; e++)
+					if ((p[(e + r) & 3] - tracks[i].pred[e]).norm2() > max_error2)
+						break;
+				if (e == 4)
+					break;
+			}
+			if (r == 4)
+				continue;
+
+			// two arucos can't continue the same track
+			for (matched = 0; matched < arucos_found; matched++)
+				if (found[matched].match == i)
+					break;
+			if (matched < arucos_found)
+				continue;
+
+			a.aruco_idx = tracks[i].aruco_idx;
+			a.dictionary = tracks[i].dictionary;
+			cand_rotation = (4 - r) & 3;
+			rotate_corners(&a, cand_rotation);
+			return i;
+		}
+		return -1;
+	}
+
+	// convert a bounding box on frame coordinates, padded by "pad" pixels,
+	// to a window of cells, rounding outwards. Returns false if it is
+	// completely outside the frame
+	bool cell_window(float min_x, float min_y, float max_x, float max_y, float pad, int win[4])
+	{
+		win[0] = floorf((min_x - pad - FRAME_MARGIN_X) / CELL);
+		win[1] = floorf((min_y - pad - FRAME_MARGIN_Y) / CELL);
+		win[2] = ceilf((max_x + pad - FRAME_MARGIN_X) / CELL);
+		win[3] = ceilf((max_y + pad - FRAME_MARGIN_Y) / CELL);
+		if (win[0] < 0) win[0] = 0;
+		if (win[1] < 0) win[1] = 0;
+		if (win[2] > GRID_X) win[2] = GRID_X;
+		if (win[3] > GRID_Y) win[3] = GRID_Y;
+		return win[0] < win[2] && win[1] < win[3];
+	}
+
+	// bounding box of 4 corners, as in cell_window(), padded by "margin"
+	// pixels plus "ratio" times the average of its width and height
+	bool corners_window(const pt2d_t pt[4], float margin, float ratio, int win[4])
+	{
+		float min_x, min_y, max_x, max_y;
+
+		min_x = max_x = pt[0].x;
+		min_y = max_y = pt[0].y;
+		for (int e = 1; e < 4; e++) {
+			if (pt[e].x < min_x) min_x = pt[e].x;
+			if (pt[e].x > max_x) max_x = pt[e].x;
+			if (pt[e].y < min_y) min_y = pt[e].y;
+			if (pt[e].y > max_y) max_y = pt[e].y;
+		}
+		return cell_window(min_x, min_y, max_x, max_y,
+				   margin + (max_x - min_x + max_y - min_y) * 0.5f * ratio, win);
+	}
+
+	static bool windows_overlap(const int a[4], const int b[4])
+	{
+		return a[0] < b[2] && b[0] < a[2] && a[1] < b[3] && b[1] < a[3];
+	}
+
+	// merge the windows that overlap until none do, so that each aruco is
+	// only found once, and return how many are left. A grown window may
+	// overlap the ones already checked, so start again after each merge
+	static int merge_windows(int win[][4], int count)
+	{
+		int i, j;
+		bool merged = false;
+
+		for (i = 0; i < count; i++) {
+			for (j = i + 1; j < count; j++) {
+				if (!windows_overlap(win[i], win[j]))
+					continue;
+				if (win[j][0] < win[i][0]) win[i][0] = win[j][0];
+				if (win[j][1] < win[i][1]) win[i][1] = win[j][1];
+				if (win[j][2] > win[i][2]) win[i][2] = win[j][2];
+				if (win[j][3] > win[i][3]) win[i][3] = win[j][3];
+				count--;
+				memcpy(win[j], win[count], sizeof(win[j]));
+				merged = true;
+				break;
+			}
+			if (merged) {
+				merged = false;
+				i = -1;
+			}
+		}
+		return count;
+	}
+
+	void process_windows(const int win[][4], int count)
+	{
+		for (int i = 0; i < count && arucos_found < MAX_ARUCO_COUNT; i++) {
+			set_window(win[i][0], win[i][1], win[i][2], win[i][3]);
+			process_window();
+			if (stop_when_all_found && all_allowed_found())
+				break;
+		}
+	}
+
+	// process the windows around the predicted position of the tracked
+	// arucos
+	void process_tracks(void)
+	{
+		int win[MAX_WINDOWS][4];
+		int i, count;
+
+		count = 0;
+		for (i = 0; i < track_count; i++)
+			if (corners_window(tracks[i].pred, tracking.margin, 0.25f, win[count]))
+				count++;
+
+		count = merge_windows(win, count);
+		process_windows(win, count);
+	}
+
+	// sum the pixels of every cell and return the windows around the cells
+	// that changed. The changed rows of cells are grouped in bands, which
+	// span all the changed cells of their rows
+	int find_changes(int win[][4])
+	{
+		uint32_t total, ix, iy;
+		int gy, gx, x0, x1, count, margin, diff;
+		int threshold = incremental.threshold * CELL * CELL;
+		const uint8_t *ptr;
+
+		count = 0;
+		cells_changed = 0;
+		margin = incremental.margin;
+		for (gy = 0; gy < GRID_Y; gy++) {
+			x0 = GRID_X;
+			x1 = 0;
+			for (gx = 0; gx < GRID_X; gx++) {
+				total = 0;
+				ptr = frame_row(gy * CELL + FRAME_MARGIN_Y) + gx * CELL + FRAME_MARGIN_X;
+
+				for (iy = 0; iy < CELL; iy++, ptr += row_stride())
+					for (ix = 0; ix < CELL; ix++)
+						total += ptr[ix];
+				cell_sum[gy][gx] = total;
+
+				diff = (int)total - cell_reference[gy][gx];
+				if (diff > threshold || diff < -threshold) {
+					if (gx < x0) x0 = gx;
+					x1 = gx + 1;
+					cells_changed++;
+				}
+			}
+			if (x0 >= x1)
+				continue;
+
+			x0 = x0 > margin ? x0 - margin : 0;
+			x1 = x1 + margin < GRID_X ? x1 + margin : GRID_X;
+			// extend the previous band if they overlap or touch
+			if (count > 0 && win[count - 1][3] >= gy - margin) {
+				if (x0 < win[count - 1][0]) win[count - 1][0] = x0;
+				if (x1 > win[count - 1][2]) win[count - 1][2] = x1;
+			} else {
+				win[count][0] = x0;
+				win[count][1] = gy > margin ? gy - margin : 0;
+				win[count][2] = x1;
+				count++;
+			}
+			win[count - 1][3] = gy + 1 + margin < GRID_Y ? gy + 1 + margin : GRID_Y;
+		}
+		return count;
+	}
+
+	// process only the cells that changed, keeping the arucos found on the
+	// previous frames elsewhere. The first frame is processed whole
+	void process_changes(void)
+	{
+		int win[MAX_WINDOWS][4];
+		int i, j, count, cached, kept, x, y;
+		bool grown;
+
+		cached = has_reference ? arucos_found : 0;
+		start_frame();
+
+		count = find_changes(win);
+		discovery = !has_reference;
+		if (discovery) {
+			cells_changed = GRID_X * GRID_Y;
+			win[0][0] = 0;
+			win[0][1] = 0;
+			win[0][2] = GRID_X;
+			win[0][3] = GRID_Y;
+			count = 1;
+		}
+
+		// the arucos cut by a window are found again, so grow the window
+		// to include them
+		do {
+			count = merge_windows(win, count);
+			grown = false;
+			for (i = 0; i < cached; i++) {
+				if (footprint[i][0] < 0)
+					continue;
+				for (j = 0; j < count && !windows_overlap(footprint[i], win[j]); j++)
+					;
+				if (j == count)
+					continue;
+				memcpy(win[count++], footprint[i], sizeof(win[0]));
+				footprint[i][0] = -1;
+				grown = true;
+			}
+		} while (grown);
+
+		for (i = kept = 0; i < cached; i++) {
+			if (footprint[i][0] < 0)
+				continue;
+			result[kept] = result[i];
+			if (QUALITY)
+				quality[kept] = quality[i];
+			memcpy(result_box[kept], result_box[i], sizeof(result_box[0]));
+			memcpy(footprint[kept], footprint[i], sizeof(footprint[0]));
+			kept++;
+		}
+		arucos_found = kept;
+
+		// the arucos kept from the previous frame count as found for
+		// stop_when_all_found, like the ones found again
+		if (stop_when_all_found)
+			for (i = 0; i < kept; i++)
+				if (is_allowed(result[i].dictionary, result[i].aruco_idx) &&
+				    !already_found(result[i].dictionary, result[i].aruco_idx, i))
+					allowed_found++;
+
+		process_windows(win, count);
+
+		// the processed cells are the reference for the next frames. If the
+		// frame is incomplete, process them again on the next one
+		if (incomplete)
+			return;
+		for (i = 0; i < count; i++)
+			for (y = win[i][1]; y < win[i][3]; y++)
+				for (x = win[i][0]; x < win[i][2]; x++)
+					cell_reference[y][x] = cell_sum[y][x];
+		has_reference = true;
+	}
+
+	// continue the tracks with the arucos found on this frame, predicting
+	// their position on the next one with their current velocity
+	void update_tracks(void)
 	{
+		int i, j, e, best, count;
+		float dist, best_dist;
+		pt2d_t center;
+
+		track_lost = false;
+		for (i = 0; i < arucos_found; i++) {
+			track_t &t = found[i];
+
+			// arucos that had to be decoded continue the nearest track
+			// with their id, if it is closer than its size
+			if (t.match < 0) {
+				center = (t.last[0] + t.last[2]) * 0.5f;
+				best_dist = (t.last[2] - t.last[0]).norm2();
+				for (j = 0; j < track_count; j++) {
+					if (tracks[j].aruco_idx != t.aruco_idx || tracks[j].dictionary != t.dictionary)
+						continue;
+					dist = ((tracks[j].pred[0] + tracks[j].pred[2]) * 0.5f - center).norm2();
+					if (dist < best_dist) {
+						best_dist = dist;
+						t.match = j;
+					}
+				}
+				for (j = 0; j < i && t.match >= 0; j++)
+					if (found[j].match == t.match)
+						t.match = -1;
+			}
+
+			for (e = 0; e < 4; e++) {
+				t.pred[e] = t.last[e];
+				if (t.match >= 0)
+					t.pred[e] += t.last[e] - tracks[t.match].last[e];
+			}
+		}
+
+		// a tracked aruco missing outside of a discovery frame forces one,
+		// unless the frame was stopped by its deadline
+		if (!discovery && !incomplete) {
+			for (j = 0; j < track_count; j++) {
+				for (i = 0, best = 0; i < arucos_found && !best; i++)
+					best = (found[i].match == j);
+				if (!best)
+					track_lost = true;
+			}
+		}
+
+		// the arucos that weren't reached before the deadline are still
+		// tracked, from where they were last found
+		count = arucos_found;
+		for (j = 0; j < track_count && incomplete && count < MAX_ARUCO_COUNT; j++) {
+			for (i = 0, best = 0; i < arucos_found && !best; i++)
+				best = (found[i].match == j);
+			if (!best)
+				found[count++] = tracks[j];
+		}
+
+		for (i = 0; i < count; i++)
+			tracks[i] = found[i];
+		track_count = count;
+	}
+
+	// true once the deadline of the frame has passed, if it has one
+	bool deadline_passed(void)
+	{
+		if (has_deadline && !incomplete)
+			incomplete = (int32_t)(ARUCO_MICROS() - frame_deadline) >= 0;
+		return incomplete;
+	}
+
+	void start_frame(void)
+	{
+		// the results are overwritten while the frame is processed (by
+		// each window in tracking and incremental modes), so keep where
+		// the arucos of the previous frame were
+		previous_found = arucos_found;
+		if (has_deadline)
+			memcpy(previous_box, result_box, previous_found * sizeof(previous_box[0]));
+		incomplete = false;
 		arucos_found = 0;
-		for (int i = 0; i < aruco_count; i++) {
-			if (aruco_seg_count[i] != -1)
-				process_aruco(i);
+		edges_decimated = 0;
+		allowed_found = 0;
+		memset(&rejects, 0, sizeof(rejects));
+	}
+
+	void set_window(int x0, int y0, int x1, int y1)
+	{
+		win_x0 = x0;
+		win_y0 = y0;
+		win_x1 = x1;
+		win_y1 = y1;
+	}
+
+	// find the arucos inside the window, adding them to the results
+	void process_window(void)
+	{
+		compute_local_contrast();
+		if (deadline_passed())
+			return;
+		build_segments();
+		if (deadline_passed())
+			return;
+		process_finish();
+	}
+
+	// priority of a candidate when there is a deadline: its number of
+	// segments (its height, roughly), above all if its last segment is
+	// inside the box of an aruco found on the previous frame. It fits in
+	// an int16_t
+	int candidate_priority(int idx)
+	{
+		const segment_t &seg = segments[arucos[idx]];
+		int i, x = seg.start + seg.length / 2;
+
+		for (i = 0; i < previous_found; i++) {
+			const int16_t *box = previous_box[i];
+			if (x >= box[0] && x <= box[2] && seg.y >= box[1] && seg.y <= box[3])
+				return aruco_seg_count[idx] + 0x4000;
+		}
+		return aruco_seg_count[idx];
+	}
+
+	void process_finish(void)
+	{
+		int i, best;
+
+		if (!has_deadline) {
+			for (i = 0; i < aruco_count; i++) {
+				if (aruco_seg_count[i] != -1)
+					process_aruco(i);
+				if (stop_when_all_found && all_allowed_found())
+					break;
+			}
+			return;
+		}
+
+		// aruco_y_start is not needed once the segments are built, so
+		// it holds the priority of each candidate left (-1 if none)
+		for (i = 0; i < aruco_count; i++)
+			aruco_y_start[i] = aruco_seg_count[i] == -1 ? -1 : candidate_priority(i);
+
+		// process the candidates by decreasing priority. There are few
+		// of them, so just search the next one each time
+		while (!deadline_passed()) {
+			best = -1;
+			for (i = 0; i < aruco_count; i++)
+				if (aruco_y_start[i] >= 0 && (best < 0 || aruco_y_start[i] > aruco_y_start[best]))
+					best = i;
+			if (best < 0)
+				break;
+			aruco_y_start[best] = -1;
+			process_aruco(best);
+			if (stop_when_all_found && all_allowed_found())
+				break;
 		}
 	}
 
@@ -979,15 +3072,7 @@ protected:
 	void debug_clear_frame(void) {
 		if (!DEBUG)
 			return;
-		// gcc warns "‘memset’ used with length equal to number of
-		// elements without multiplication by element size" without
-		// checking that the size is actually zero, so we just disable
-		// the warning for this memset. The zero case only happens in
-		// not debug mode and the memset is not executed in that case
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wmemset-elt-size"
-			memset(debug_frame, ADP_GRAY, sizeof(debug_frame));
-		#pragma GCC diagnostic pop
+		memset(debug_frame[0], ADP_GRAY, FRAME_SIZE);
 	}
 
 	void debug_plot(int x, int y, int color) {
@@ -0,0 +1,349 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdint.h>
+
+// lookup of the codes read from the arucos on a dictionary. A dictionary is
+// described by an aruco_dictionary_t, that points to two tables: the codes of
+// the 4 rotations of each aruco, and a hash table of those codes, so that a
+// lookup needs on average less than 2 compares, found or not, instead of
+// searching the whole dictionary for every candidate (most of which are not
+// arucos at all). To tolerate read errors, find_nearest() searches the
+// nearest code by its hamming distance, which costs a xor and a population
+// count per entry.
+// To save space, a dictionary can store only the canonical rotation of each
+// aruco instead. The code read is then rotated (with aruco_rotate_code()) and
+// looked up 4 times, which takes about 4 times longer, for a quarter of the
+// space.
+// The tables of the database selected with ARUCO_DB are generated from its
+// canonical codes (see database.h) when compiling, by aruco_dictionary_tables_t,
+// so they end up in read only memory and only take space for the arucos that
+// are used. This needs C++14 constexpr support. The same tables can also be
+// loaded from a binary file (see dictionary_file.h)
+
+// number of bits set, adding the bits in parallel on wider and wider fields.
+// Compilers turn this into a single instruction on targets that have one
+static inline int aruco_popcount64(uint64_t v)
+{
+	v = v - ((v >> 1) & 0x5555555555555555ull);
+	v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return (v * 0x0101010101010101ull) >> 56;
+}
+
+// rotate the code of an aruco of bits x bits cells 90 degrees counterclockwise:
+// the cell on row r and column c comes from row c and column bits - 1 - r. The
+// rows are spread to the bytes of an 8x8 bit matrix, which is transposed with
+// 3 delta swaps, and the rows of the transposed matrix are packed back in
+// reverse order. This also works when compiling, to generate the rotations
+static constexpr uint64_t aruco_rotate_code(uint64_t code, int bits)
+{
+	// C++14 constexpr functions need initialized variables
+	uint64_t m = 0, t = 0, res = 0, mask = (1u << bits) - 1;
+	int r = 0;
+
+	// row r goes to byte 7 - r, with column 0 on the top bit of the byte
+	for (r = 0; r < bits; r++)
+		m |= ((code >> (bits * (bits - 1 - r))) & mask) << (8 * (7 - r) + 8 - bits);
+
+	t = (m ^ (m >> 7)) & 0x00AA00AA00AA00AAull;
+	m = m ^ t ^ (t << 7);
+	t = (m ^ (m >> 14)) & 0x0000CCCC0000CCCCull;
+	m = m ^ t ^ (t << 14);
+	t = (m ^ (m >> 28)) & 0x00000000F0F0F0F0ull;
+	m = m ^ t ^ (t << 28);
+
+	for (r = bits - 1; r >= 0; r--)
+		res = (res << bits) | ((m >> (8 * (7 - r) + 8 - bits)) & mask);
+	return res;
+}
+
+// rotate the code of an aruco of bits x bits cells 180 degrees, which just
+// reverses the order of its bits
+static constexpr uint64_t aruco_reverse_code(uint64_t code, int bits)
+{
+	code = ((code >> 1) & 0x5555555555555555ull) | ((code & 0x5555555555555555ull) << 1);
+	code = ((code >> 2) & 0x3333333333333333ull) | ((code & 0x3333333333333333ull) << 2);
+	code = ((code >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((code & 0x0F0F0F0F0F0F0F0Full) << 4);
+	code = ((code >> 8) & 0x00FF00FF00FF00FFull) | ((code & 0x00FF00FF00FF00FFull) << 8);
+	code = ((code >> 16) & 0x0000FFFF0000FFFFull) | ((code & 0x0000FFFF0000FFFFull) << 16);
+	code = (code >> 32) | (code << 32);
+	return code >> (64 - bits * bits);
+}
+
+// the code rotated counterclockwise 0, 1, 2 and 3 times
+static inline void aruco_code_rotations(uint64_t code, int bits, uint64_t rot[4])
+{
+	rot[0] = code;
+	rot[1] = aruco_rotate_code(code, bits);
+	rot[2] = aruco_reverse_code(code, bits);
+	rot[3] = aruco_reverse_code(rot[1], bits);
+}
+
+// multiplicative hash of a code, for a table of 1 << shift slots
+static constexpr uint32_t aruco_dictionary_hash(uint64_t code, int shift)
+{
+	return (code * 0x9E3779B97F4A7C15ull) >> (64 - shift);
+}
+
+// smallest table (a power of 2) that is at most 3/4 full with "entries"
+static constexpr int aruco_dictionary_shift(int entries)
+{
+	int shift = 4;
+	while ((1 << shift) * 3 < entries * 4)
+		shift++;
+	return shift;
+}
+
+// binary dictionary file, as written by tools/dictionary_converter.cc: this
+// header, followed by the rotations and the hash table at the given offsets,
+// which are multiples of 8. All the values are little endian, and the file is
+// used in place, without copying
+#define ARUCO_DICTIONARY_MAGIC		0x43444C41	// "ALDC"
+#define ARUCO_DICTIONARY_VERSION	1
+
+struct aruco_dictionary_header_t {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t bits;		// arucos of bits x bits cells
+	uint8_t code_bytes;	// size of each code: 2, 4 or 8 bytes
+	uint32_t size;		// number of arucos
+	uint32_t table_shift;	// the hash table has 1 << table_shift slots
+	uint32_t rotations_offset;
+	uint32_t table_offset;
+	uint32_t file_size;
+	uint32_t stored_rotations;	// 4, or 1 for the canonical rotation only
+};
+
+class aruco_dictionary_t {
+public:
+	static constexpr uint16_t EMPTY = 0xFFFF;
+
+	int bits;		// arucos of bits x bits cells
+	int size;		// number of arucos
+	int code_bytes;		// size of each code: 2, 4 or 8 bytes
+	int table_shift;	// the hash table has 1 << table_shift slots
+	int stored_rotations;	// 4, or 1 for the canonical rotation only
+	const void *rotations;	// code of stored entry stored_rotations * index + rotation
+	const uint16_t *table;	// stored entries, or EMPTY
+
+	// code of an aruco in a rotation, in the format of database.h
+	uint64_t code(int index, int rotation) const {
+		uint64_t rot[4];
+
+		if (stored_rotations == 4)
+			return code_at(index * 4 + rotation);
+		aruco_code_rotations(code_at(index), bits, rot);
+		return rot[rotation];
+	}
+
+	// returns 4 * index + rotation of the entry that matches "code", or
+	// -1 if there is none. When a code appears more than once on the
+	// dictionary, the first one is returned, like a linear search
+	int find(uint64_t code) const {
+		uint64_t rot_code[4];
+		int rot, entry, best = -1;
+
+		if (stored_rotations == 4)
+			return find_stored(code);
+
+		// rotating the code counterclockwise "rot" times gives the
+		// canonical code of an aruco seen in rotation (4 - rot) & 3.
+		// Keep the first entry, as if all the rotations were stored
+		aruco_code_rotations(code, bits, rot_code);
+		for (rot = 0; rot < 4; rot++) {
+			entry = find_stored(rot_code[rot]);
+			if (entry >= 0) {
+				entry = entry * 4 + ((4 - rot) & 3);
+				if (best < 0 || entry < best)
+					best = entry;
+			}
+		}
+		return best;
+	}
+
+	// returns the entry (like find()) nearest to "code" if it differs in
+	// at most "radius" bits, and the number of differing bits in
+	// "distance". Codes that are as near to two entries are rejected. This
+	// compares the code with all the entries, so do a find() first
+	int find_nearest(uint64_t code, int radius, int &distance) const {
+		uint64_t rot_code[4];
+		int i, d, rot, best = radius + 1, best_entry = -1;
+		int count = size * stored_rotations, scale = 4 / stored_rotations;
+
+		// with only the canonical rotations, compare them with the 4
+		// rotations of the code instead, like find()
+		aruco_code_rotations(code, bits, rot_code);
+		for (rot = 0; rot < scale; rot++) {
+			for (i = 0; i < count; i++) {
+				d = aruco_popcount64(rot_code[rot] ^ code_at(i));
+				if (d < best) {
+					best = d;
+					best_entry = i * scale + ((4 - rot) & 3);
+				} else if (d == best) {
+					best_entry = -1;
+				}
+			}
+		}
+		distance = best;
+		return best_entry;
+	}
+
+	// use the tables of a binary dictionary file loaded (or mapped) at
+	// "data", which must be aligned to 8 bytes. Returns false if it is not
+	// a valid dictionary. Besides the header, the hash table is checked,
+	// since the lookups trust its entries: each slot must be empty or an
+	// entry of the dictionary, and at least one must be empty to end the
+	// probing
+	bool load(const void *data, uint32_t len) {
+		const aruco_dictionary_header_t *h = (const aruco_dictionary_header_t *)data;
+		const uint16_t *slots;
+		uint32_t table_len, i, empty;
+
+		if (((uintptr_t)data & 7) != 0 || len < sizeof(*h))
+			return false;
+		if (h->magic != ARUCO_DICTIONARY_MAGIC || h->version != ARUCO_DICTIONARY_VERSION)
+			return false;
+		if (h->bits < 3 || h->bits > 8 || h->size == 0 || h->size > EMPTY / 4)
+			return false;
+		if ((h->code_bytes != 2 && h->code_bytes != 4 && h->code_bytes != 8) ||
+		    h->bits * h->bits > h->code_bytes * 8 || (h->stored_rotations != 1 && h->stored_rotations != 4))
+			return false;
+		if (h->table_shift < 4 || h->table_shift > 16 || (1u << h->table_shift) <= h->size * h->stored_rotations)
+			return false;
+		table_len = (1u << h->table_shift) * 2;
+		if (h->file_size != len || (h->rotations_offset & 7) != 0 || (h->table_offset & 7) != 0 ||
+		    h->rotations_offset < sizeof(*h) || h->rotations_offset > len ||
+		    len - h->rotations_offset < h->size * h->stored_rotations * h->code_bytes ||
+		    h->table_offset < sizeof(*h) || h->table_offset > len ||
+		    len - h->table_offset < table_len)
+			return false;
+
+		slots = (const uint16_t *)((const uint8_t *)data + h->table_offset);
+		for (i = empty = 0; i < (1u << h->table_shift); i++) {
+			if (slots[i] == EMPTY)
+				empty++;
+			else if (slots[i] >= h->size * h->stored_rotations)
+				return false;
+		}
+		if (empty == 0)
+			return false;
+
+		bits = h->bits;
+		size = h->size;
+		code_bytes = h->code_bytes;
+		table_shift = h->table_shift;
+		stored_rotations = h->stored_rotations;
+		rotations = (const uint8_t *)data + h->rotations_offset;
+		table = slots;
+		return true;
+	}
+
+protected:
+	// returns the stored entry that matches "code", or -1
+	int find_stored(uint64_t code) const {
+		uint32_t h = aruco_dictionary_hash(code, table_shift);
+		uint32_t mask = (1 << table_shift) - 1;
+		uint16_t entry;
+
+		while ((entry = table[h]) != EMPTY) {
+			if (code_at(entry) == code)
+				return entry;
+			h = (h + 1) & mask;
+		}
+		return -1;
+	}
+
+	uint64_t code_at(int entry) const {
+		if (code_bytes == 2)
+			return ((const uint16_t *)rotations)[entry];
+		if (code_bytes == 4)
+			return ((const uint32_t *)rotations)[entry];
+		return ((const uint64_t *)rotations)[entry];
+	}
+};
+
+// smallest integer type that holds the codes of CODE_BITS bits, to store the
+// rotations
+template <int CODE_BITS, bool FITS_16 = (CODE_BITS <= 16), bool FITS_32 = (CODE_BITS <= 32)>
+struct aruco_code_type { typedef uint64_t type; };
+template <int CODE_BITS>
+struct aruco_code_type<CODE_BITS, false, true> { typedef uint32_t type; };
+template <int CODE_BITS>
+struct aruco_code_type<CODE_BITS, true, true> { typedef uint16_t type; };
+
+// tables of the first SIZE arucos of CODES, which are BITS x BITS cells,
+// generated when compiling. ROTATIONS is the number of rotations stored per
+// aruco: 4, or 1 to store only the canonical rotation
+template <int SIZE, int BITS, const uint64_t *CODES, int ROTATIONS = 4>
+class aruco_dictionary_tables_t {
+public:
+	static constexpr int CODE_BITS = BITS * BITS;
+	static constexpr int ENTRIES = SIZE * ROTATIONS;
+	static constexpr int TABLE_SHIFT = aruco_dictionary_shift(ENTRIES);
+	static constexpr int TABLE_SIZE = 1 << TABLE_SHIFT;
+
+	typedef typename aruco_code_type<CODE_BITS>::type code_t;
+
+	// the stored rotations of the arucos, entry ROTATIONS * index + rotation
+	struct rotations_t {
+		code_t code[ENTRIES];
+	};
+
+	struct table_t {
+		uint16_t slot[TABLE_SIZE];
+	};
+
+protected:
+	static constexpr rotations_t build_rotations(void) {
+		rotations_t t = {};
+
+		for (int i = 0; i < SIZE; i++) {
+			uint64_t code = CODES[i];
+			for (int j = 0; j < ROTATIONS; j++) {
+				t.code[i * ROTATIONS + j] = code;
+				code = aruco_rotate_code(code, BITS);
+			}
+		}
+		return t;
+	}
+
+	// insert the entries in dictionary order, with linear probing
+	static constexpr table_t build_table(void) {
+		table_t t = {};
+
+		for (int i = 0; i < TABLE_SIZE; i++)
+			t.slot[i] = aruco_dictionary_t::EMPTY;
+
+		for (int i = 0; i < ENTRIES; i++) {
+			// C++14 constexpr functions need initialized variables
+			uint32_t h = aruco_dictionary_hash(rotations.code[i], TABLE_SHIFT);
+			uint16_t entry = t.slot[h];
+
+			while (entry != aruco_dictionary_t::EMPTY && rotations.code[entry] != rotations.code[i]) {
+				h = (h + 1) & (TABLE_SIZE - 1);
+				entry = t.slot[h];
+			}
+			if (entry == aruco_dictionary_t::EMPTY)
+				t.slot[h] = i;
+		}
+		return t;
+	}
+
+public:
+	static constexpr rotations_t rotations = build_rotations();
+	static constexpr table_t table = build_table();
+
+	static constexpr aruco_dictionary_t dictionary = {
+		BITS, SIZE, sizeof(code_t), TABLE_SHIFT, ROTATIONS, rotations.code, table.slot
+	};
+};
+
+template <int SIZE, int BITS, const uint64_t *CODES, int ROTATIONS>
+constexpr typename aruco_dictionary_tables_t<SIZE, BITS, CODES, ROTATIONS>::rotations_t aruco_dictionary_tables_t<SIZE, BITS, CODES, ROTATIONS>::rotations;
+template <int SIZE, int BITS, const uint64_t *CODES, int ROTATIONS>
+constexpr typename aruco_dictionary_tables_t<SIZE, BITS, CODES, ROTATIONS>::table_t aruco_dictionary_tables_t<SIZE, BITS, CODES, ROTATIONS>::table;
+template <int SIZE, int BITS, const uint64_t *CODES, int ROTATIONS>
+constexpr aruco_dictionary_t aruco_dictionary_tables_t<SIZE, BITS, CODES, ROTATIONS>::dictionary;
+
+#endif
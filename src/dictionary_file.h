@@ -0,0 +1,66 @@
+#ifndef DICTIONARY_FILE_H
+#define DICTIONARY_FILE_H
+
+// map a binary dictionary file (see dictionary.h) to memory, on systems with
+// POSIX mmap, like Linux. The tables are used directly from the mapped file,
+// so loading only reads the hash table, to check it, and the rotations are
+// only paged in when they are used. On micro-controllers, store the file in flash instead (for example as
+// an array aligned to 8 bytes) and call aruco_dictionary_t::load() on it
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dictionary.h"
+
+class aruco_dictionary_file_t {
+public:
+	// valid after a successful open()
+	aruco_dictionary_t dictionary;
+
+	aruco_dictionary_file_t() : data(MAP_FAILED), len(0) {}
+	~aruco_dictionary_file_t() {
+		close();
+	}
+
+	// the dictionary points into the mapping, so it can't be copied
+	aruco_dictionary_file_t(const aruco_dictionary_file_t &) = delete;
+	aruco_dictionary_file_t &operator=(const aruco_dictionary_file_t &) = delete;
+
+	// returns false if the file can't be mapped or isn't a valid dictionary
+	bool open(const char *path) {
+		struct stat st;
+		int fd;
+
+		close();
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > 0x7FFFFFFF) {
+			::close(fd);
+			return false;
+		}
+		len = st.st_size;
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if (data == MAP_FAILED || !dictionary.load(data, len)) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close(void) {
+		if (data != MAP_FAILED)
+			munmap(data, len);
+		data = MAP_FAILED;
+		len = 0;
+	}
+
+protected:
+	void *data;
+	size_t len;
+};
+
+#endif
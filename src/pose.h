@@ -0,0 +1,344 @@
+#ifndef POSE_H
+#define POSE_H
+
+#include <stdlib.h>
+#include "vector.h"
+
+// planar pose estimation of square arucos, using the analytic IPPE solver
+// (Collins and Bartoli, "Infinitesimal Plane-based Pose Estimation", 2014).
+//
+// The arucos are collected in batches of POSE_LANES arucos stored as a
+// structure of arrays, and solved one after the other, with branches for the
+// degenerate cases and for the choice between the two solutions. Like the
+// geometry classes, the solver is a template on the scalar type, to use
+// "float" or "fix16_t"
+
+// pinhole camera intrinsics, in pixels, in the coordinates of the corners (the
+// center of the top left pixel is (0.5, 0.5)). The corners must be undistorted
+struct aruco_camera_t {
+	float fx, fy;
+	float cx, cy;
+};
+
+// pose of an aruco in camera coordinates. A point (x, y, 0) on the aruco, with
+// the origin at the center of the aruco, x towards pt[1] - pt[0] and y towards
+// pt[0] - pt[3], is at r * (x, y, 0) + t. The translation is in the same units
+// as the side length given to the solver
+template <class T>
+struct aruco_pose_base_t {
+	T r[3][3];
+	T t[3];
+	// RMS reprojection error of the corners, in pixels
+	T err;
+	// false if the corners don't define a valid pose
+	bool valid;
+
+	// conversion between poses with different scalar types
+	template <class U>
+	void set(const aruco_pose_base_t<U> &p) {
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++)
+				r[i][j] = T(p.r[i][j]);
+			t[i] = T(p.t[i]);
+		}
+		err = T(p.err);
+		valid = p.valid;
+	}
+};
+
+typedef aruco_pose_base_t<float> aruco_pose_t;
+
+template <class T>
+class aruco_pose_solver_t {
+public:
+	static constexpr int POSE_LANES = 8;
+
+	aruco_pose_solver_t() {
+		count = 0;
+	}
+
+	// add the corners of one aruco to the batch, in pixels. Returns false if
+	// the batch is already full
+	template <class U>
+	bool add(const aruco_camera_t &cam, const pt2d_base_t<U> pt[4])
+	{
+		int i, k, ext, off;
+
+		if (count >= POSE_LANES)
+			return false;
+
+		// the corners are scaled by a power of two "k" so that their
+		// spread is close to 1 and the products stay in range with fixed
+		// point. The size is estimated by the sum of the diagonals
+		ext = abs((int)pt[2].x - (int)pt[0].x) + abs((int)pt[2].y - (int)pt[0].y) +
+		      abs((int)pt[3].x - (int)pt[1].x) + abs((int)pt[3].y - (int)pt[1].y) + 1;
+		off = 0;
+		for (i = 0; i < 4; i++) {
+			off = max_int(off, abs((int)(pt[i].x - U(cam.cx))));
+			off = max_int(off, abs((int)(pt[i].y - U(cam.cy))));
+		}
+		for (k = 1; k < MAX_SCALE; k *= 2)
+			if (ext * k * 2 > cam.fx * 4 || (off + 1) * k * 2 > cam.fx * MAX_OFFSET)
+				break;
+
+		for (i = 0; i < 4; i++) {
+			x[i][count] = T(float(pt[i].x) - cam.cx) * T(k) / T(cam.fx);
+			y[i][count] = T(float(pt[i].y) - cam.cy) * T(k) / T(cam.fy);
+		}
+		scale[count] = k;
+		count++;
+		return true;
+	}
+
+	int size(void) const {
+		return count;
+	}
+
+	// compute the poses of all the arucos in the batch, of side "side", and
+	// empty the batch
+	void solve(const aruco_camera_t &cam, float side, aruco_pose_base_t<T> *pose)
+	{
+		typedef geom_traits<T> gt;
+		T s, f, p, q, d, iw;
+		T g, h, a, b, c, e, dx1, dx2, dy1, dy2, sx, sy;
+		T j00, j01, j10, j11, b00, b01, b10, b11, n;
+		T a00, a01, a10, a11, t00, t01, t10, t11, ata00, ata01, ata11, dd, rt, u, v;
+		T rv[3][3], m[3][3], r1[3][3], r2[3][3], t1[3], t2[3], b0, b1;
+		float e1, e2;
+		int l, i, j;
+
+		for (l = 0; l < count; l++) {
+			// homography from the unit square to the corners, with u
+			// along pt0 -> pt1 and v along pt0 -> pt3
+			dx1 = x[1][l] - x[2][l];
+			dx2 = x[3][l] - x[2][l];
+			dy1 = y[1][l] - y[2][l];
+			dy2 = y[3][l] - y[2][l];
+			sx = x[0][l] - x[1][l] + x[2][l] - x[3][l];
+			sy = y[0][l] - y[1][l] + y[2][l] - y[3][l];
+			d = dx1 * dy2 - dx2 * dy1;
+			pose[l].valid = (d != T(0));
+			if (!pose[l].valid)
+				d = T(1);
+			g = (sx * dy2 - dx2 * sy) / d;
+			h = (dx1 * sy - sx * dy1) / d;
+			a = x[1][l] - x[0][l] + g * x[1][l];
+			b = x[3][l] - x[0][l] + h * x[3][l];
+			c = y[1][l] - y[0][l] + g * y[1][l];
+			e = y[3][l] - y[0][l] + h * y[3][l];
+
+			// the same homography, from the aruco plane with the
+			// origin at the center and a half side of 1: x = 2u - 1,
+			// y = 1 - 2v. "p, q" is the image of the center and "j"
+			// the jacobian of the homography at the center
+			iw = T(1) / ((g + h) * T(0.5f) + T(1));
+			p = ((a + b) * T(0.5f) + x[0][l]) * iw;
+			q = ((c + e) * T(0.5f) + y[0][l]) * iw;
+			j00 = (a - g * p) * T(0.5f) * iw;
+			j01 = (h * p - b) * T(0.5f) * iw;
+			j10 = (c - g * q) * T(0.5f) * iw;
+			j11 = (h * q - e) * T(0.5f) * iw;
+			p = p / T(scale[l]);
+			q = q / T(scale[l]);
+
+			// rotation that takes the optical axis to the direction
+			// of the center of the aruco
+			s = gt::sqrt(p * p + q * q + T(1));
+			f = T(1) / (s * (s + T(1)));
+			rv[0][0] = T(1) - f * p * p;
+			rv[0][1] = -f * p * q;
+			rv[0][2] = p / s;
+			rv[1][0] = rv[0][1];
+			rv[1][1] = T(1) - f * q * q;
+			rv[1][2] = q / s;
+			rv[2][0] = -rv[0][2];
+			rv[2][1] = -rv[1][2];
+			rv[2][2] = T(1) / s;
+
+			// A = B^-1 * J, with B = [1 0 -p; 0 1 -q] * rv[:, 0:2]
+			b00 = rv[0][0] - p * rv[2][0];
+			b01 = rv[0][1] - p * rv[2][1];
+			b10 = rv[1][0] - q * rv[2][0];
+			b11 = rv[1][1] - q * rv[2][1];
+			d = b00 * b11 - b01 * b10;
+			a00 = (b11 * j00 - b01 * j10) / d;
+			a01 = (b11 * j01 - b01 * j11) / d;
+			a10 = (b00 * j10 - b10 * j00) / d;
+			a11 = (b00 * j11 - b10 * j01) / d;
+
+			// the top left 2x2 block of the rotation is A divided by
+			// its largest singular value. Normalize A first, so that
+			// its squares keep their precision with fixed point
+			n = gt::abs(a00) + gt::abs(a01) + gt::abs(a10) + gt::abs(a11);
+			if (n == T(0)) {
+				pose[l].valid = false;
+				n = T(1);
+			}
+			n = T(1) / n;
+			a00 = a00 * n;
+			a01 = a01 * n;
+			a10 = a10 * n;
+			a11 = a11 * n;
+			ata00 = a00 * a00 + a10 * a10;
+			ata01 = a00 * a01 + a10 * a11;
+			ata11 = a01 * a01 + a11 * a11;
+
+			// the rest of the first two columns is b0 = sqrt(g2 - ata00),
+			// b1 = sqrt(g2 - ata11), divided by the singular value
+			// sqrt(g2). Both are small for arucos facing the camera, so
+			// they are computed in a way that avoids cancellation. They
+			// have two solutions with opposite signs, the planar pose
+			// ambiguity
+			dd = ata00 - ata11;
+			u = gt::abs(dd);
+			v = gt::abs(ata01) * T(2);
+			rt = u > v ? u : v;
+			if (rt > T(0)) {
+				u = u / rt;
+				v = v / rt;
+				rt = rt * gt::sqrt(u * u + v * v);
+			}
+			d = gt::sqrt((ata00 + ata11 + rt) * T(0.5f));
+			if (d == T(0)) {
+				pose[l].valid = false;
+				d = T(1);
+			}
+			b1 = gt::sqrt((rt + gt::abs(dd)) * T(0.5f));
+			b0 = (b1 > T(0)) ? gt::abs(ata01) / b1 : T(0);
+			if (dd < T(0)) {
+				u = b0;
+				b0 = b1;
+				b1 = u;
+			}
+			b0 = b0 / d;
+			b1 = (ata01 > T(0)) ? -b1 / d : b1 / d;
+			t00 = a00 / d;
+			t01 = a01 / d;
+			t10 = a10 / d;
+			t11 = a11 / d;
+
+			m[0][0] = t00;
+			m[0][1] = t01;
+			m[0][2] = t10 * b1 - b0 * t11;
+			m[1][0] = t10;
+			m[1][1] = t11;
+			m[1][2] = b0 * t01 - t00 * b1;
+			m[2][0] = b0;
+			m[2][1] = b1;
+			m[2][2] = t00 * t11 - t01 * t10;
+			multiply(rv, m, r1);
+			m[0][2] = -m[0][2];
+			m[1][2] = -m[1][2];
+			m[2][0] = -b0;
+			m[2][1] = -b1;
+			multiply(rv, m, r2);
+
+			// keep the solution with the lowest reprojection error
+			e1 = translation(cam, l, r1, t1);
+			e2 = translation(cam, l, r2, t2);
+			if (e2 < e1) {
+				e1 = e2;
+				for (i = 0; i < 3; i++) {
+					for (j = 0; j < 3; j++)
+						r1[i][j] = r2[i][j];
+					t1[i] = t2[i];
+				}
+			}
+
+			for (i = 0; i < 3; i++)
+				for (j = 0; j < 3; j++)
+					pose[l].r[i][j] = r1[i][j];
+			pose[l].t[0] = t1[0] / T(scale[l]) * T(side * 0.5f);
+			pose[l].t[1] = t1[1] / T(scale[l]) * T(side * 0.5f);
+			pose[l].t[2] = t1[2] * T(side * 0.5f);
+			e1 = e1 * 0.25f / (scale[l] * scale[l]);
+			pose[l].err = gt::sqrt(T(e1 < MAX_ERROR2 ? e1 : MAX_ERROR2));
+			if (pose[l].t[2] <= T(0))
+				pose[l].valid = false;
+		}
+		count = 0;
+	}
+
+protected:
+	// the corners are scaled by at most MAX_SCALE, and their coordinates
+	// are kept below MAX_OFFSET
+	static constexpr int MAX_SCALE = 32;
+	static constexpr int MAX_OFFSET = 8;
+	// the squared RMS error in pixels is clamped to stay in range with
+	// fixed point (128 pixels, far from any valid pose)
+	static constexpr int MAX_ERROR2 = 16384;
+
+	// corners of each aruco in scaled normalized image coordinates
+	T x[4][POSE_LANES];
+	T y[4][POSE_LANES];
+	int scale[POSE_LANES];
+	int count;
+
+	static int max_int(int a, int b) {
+		return a > b ? a : b;
+	}
+
+	static void multiply(const T a[3][3], const T b[3][3], T res[3][3])
+	{
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				res[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+	}
+
+	// least squares translation for the rotation "r", in scaled coordinates
+	// (the x and y components are multiplied by the lane scale). Returns
+	// the sum of the squared reprojection errors in scaled pixels, as
+	// float, since they are often below the resolution of their squares
+	// with fixed point
+	float translation(const aruco_camera_t &cam, int l, const T r[3][3], T t[3])
+	{
+		static const int8_t mx[4] = { -1, 1, 1, -1 };
+		static const int8_t my[4] = { 1, 1, -1, -1 };
+		T k = T(scale[l]), a1, a2, a3, e1, e2, su, sv, b1, b2, b3, suu, d;
+		float u, v, err;
+		T rx[4], ry[4], rz[4];
+		int i;
+
+		// with the model point rotated to (a1, a2, a3), each corner gives
+		// the equations
+		// tx - u * tz = u * a3 - k * a1 and ty - v * tz = v * a3 - k * a2
+		su = sv = b1 = b2 = b3 = suu = T(0);
+		for (i = 0; i < 4; i++) {
+			a1 = r[0][0] * T(mx[i]) + r[0][1] * T(my[i]);
+			a2 = r[1][0] * T(mx[i]) + r[1][1] * T(my[i]);
+			a3 = r[2][0] * T(mx[i]) + r[2][1] * T(my[i]);
+			rx[i] = a1 * k;
+			ry[i] = a2 * k;
+			rz[i] = a3;
+			e1 = x[i][l] * a3 - a1 * k;
+			e2 = y[i][l] * a3 - a2 * k;
+			su += x[i][l];
+			sv += y[i][l];
+			suu += x[i][l] * x[i][l] + y[i][l] * y[i][l];
+			b1 += e1;
+			b2 += e2;
+			b3 -= x[i][l] * e1 + y[i][l] * e2;
+		}
+
+		// solve the normal equations, eliminating tx and ty
+		d = suu - (su * su + sv * sv) * T(0.25f);
+		if (d == T(0))
+			d = T(1);
+		t[2] = (b3 + (su * b1 + sv * b2) * T(0.25f)) / d;
+		t[0] = (b1 + su * t[2]) * T(0.25f);
+		t[1] = (b2 + sv * t[2]) * T(0.25f);
+
+		err = 0;
+		for (i = 0; i < 4; i++) {
+			d = rz[i] + t[2];
+			if (d <= T(0))
+				return MAX_ERROR2 * 4 * MAX_SCALE * MAX_SCALE;
+			u = float((rx[i] + t[0]) / d - x[i][l]) * cam.fx;
+			v = float((ry[i] + t[1]) / d - y[i][l]) * cam.fy;
+			err += u * u + v * v;
+		}
+		return err;
+	}
+};
+
+#endif
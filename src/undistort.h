@@ -0,0 +1,140 @@
+#ifndef UNDISTORT_H
+#define UNDISTORT_H
+
+#include <string.h>
+#include "pose.h"
+
+// lens distortion correction of points, using a coarse grid of precomputed
+// displacements with bilinear interpolation, so that only the corners (and
+// optionally the bit positions) of the arucos are corrected, instead of the
+// whole frame
+
+// lens distortion coefficients of the Brown-Conrady model, in the same order
+// as OpenCV: radial k1, k2, tangential p1, p2 and radial k3
+struct aruco_distortion_t {
+	float k1, k2;
+	float p1, p2;
+	float k3;
+};
+
+// the grid nodes are 1 << GRID_SHIFT pixels apart. The grids take about
+// 4 * (FRAME_WIDTH * FRAME_HEIGHT) / GRID_STEP^2 16 bit values
+template <int FRAME_WIDTH, int FRAME_HEIGHT, int GRID_SHIFT = 4>
+class aruco_undistort_t {
+public:
+	static constexpr int GRID_STEP = 1 << GRID_SHIFT;
+	static constexpr int GRID_WIDTH = FRAME_WIDTH / GRID_STEP + 2;
+	static constexpr int GRID_HEIGHT = FRAME_HEIGHT / GRID_STEP + 2;
+
+	aruco_undistort_t() {
+		reset();
+	}
+
+	// no distortion
+	void reset(void) {
+		memset(undistort_grid, 0, sizeof(undistort_grid));
+		memset(distort_grid, 0, sizeof(distort_grid));
+	}
+
+	// compute the grids for a camera. The principal point must be in the
+	// coordinates used for the corners, where the center of the top left
+	// pixel is (0.5, 0.5). This uses floating point, but is only done once
+	void init(const aruco_camera_t &cam, const aruco_distortion_t &dist)
+	{
+		float x, y, xd, yd, dx, dy, r;
+		int gx, gy, i;
+
+		for (gy = 0; gy < GRID_HEIGHT; gy++) {
+			for (gx = 0; gx < GRID_WIDTH; gx++) {
+				xd = (gx * GRID_STEP - cam.cx) / cam.fx;
+				yd = (gy * GRID_STEP - cam.cy) / cam.fy;
+
+				// the node is a distorted position: invert the
+				// model by fixed point iteration
+				x = xd;
+				y = yd;
+				for (i = 0; i < 10; i++) {
+					model(dist, x, y, r, dx, dy);
+					x = (xd - dx) / r;
+					y = (yd - dy) / r;
+				}
+				set_node(undistort_grid[gy][gx], (x - xd) * cam.fx, (y - yd) * cam.fy);
+
+				// the node is an undistorted position
+				model(dist, xd, yd, r, dx, dy);
+				set_node(distort_grid[gy][gx], (xd * (r - 1) + dx) * cam.fx,
+					 (yd * (r - 1) + dy) * cam.fy);
+			}
+		}
+	}
+
+	// map a point of the frame to its undistorted position, and back. The
+	// coordinates are 16.16 fixed point
+	void undistort_raw16(int32_t &x, int32_t &y) const {
+		lookup(undistort_grid, x, y);
+	}
+	void distort_raw16(int32_t &x, int32_t &y) const {
+		lookup(distort_grid, x, y);
+	}
+
+	template <class T>
+	pt2d_base_t<T> undistort(const pt2d_base_t<T> &p) const {
+		int32_t x = geom_traits<T>::to_raw16(p.x), y = geom_traits<T>::to_raw16(p.y);
+
+		undistort_raw16(x, y);
+		return pt2d_base_t<T>(geom_traits<T>::from_raw16(x), geom_traits<T>::from_raw16(y));
+	}
+
+protected:
+	// displacement of each grid node, in 1/64 pixels
+	int16_t undistort_grid[GRID_HEIGHT][GRID_WIDTH][2];
+	int16_t distort_grid[GRID_HEIGHT][GRID_WIDTH][2];
+
+	// distortion of the normalized point (x, y): the distorted point is
+	// (x * r + dx, y * r + dy)
+	static void model(const aruco_distortion_t &dist, float x, float y, float &r, float &dx, float &dy)
+	{
+		float r2 = x * x + y * y;
+
+		r = 1 + r2 * (dist.k1 + r2 * (dist.k2 + r2 * dist.k3));
+		dx = 2 * dist.p1 * x * y + dist.p2 * (r2 + 2 * x * x);
+		dy = dist.p1 * (r2 + 2 * y * y) + 2 * dist.p2 * x * y;
+	}
+
+	static void set_node(int16_t node[2], float dx, float dy)
+	{
+		dx *= 64;
+		dy *= 64;
+		node[0] = dx > 32767 ? 32767 : dx < -32767 ? -32767 : (int16_t)lroundf(dx);
+		node[1] = dy > 32767 ? 32767 : dy < -32767 ? -32767 : (int16_t)lroundf(dy);
+	}
+
+	// add the displacement interpolated from the 4 surrounding nodes.
+	// Points outside the grid are extrapolated from the nearest cell
+	static void lookup(const int16_t grid[GRID_HEIGHT][GRID_WIDTH][2], int32_t &x, int32_t &y)
+	{
+		int gx, gy, fx, fy, i;
+		int32_t d[2];
+
+		gx = x >> (16 + GRID_SHIFT);
+		gy = y >> (16 + GRID_SHIFT);
+		gx = gx < 0 ? 0 : gx > GRID_WIDTH - 2 ? GRID_WIDTH - 2 : gx;
+		gy = gy < 0 ? 0 : gy > GRID_HEIGHT - 2 ? GRID_HEIGHT - 2 : gy;
+
+		// position inside the cell, in 1/256 of the cell
+		fx = (x - (gx << (16 + GRID_SHIFT))) >> (8 + GRID_SHIFT);
+		fy = (y - (gy << (16 + GRID_SHIFT))) >> (8 + GRID_SHIFT);
+
+		for (i = 0; i < 2; i++) {
+			int32_t top = grid[gy][gx][i] * 256 + (grid[gy][gx + 1][i] - grid[gy][gx][i]) * fx;
+			int32_t bottom = grid[gy + 1][gx][i] * 256 + (grid[gy + 1][gx + 1][i] - grid[gy + 1][gx][i]) * fx;
+
+			// 1/64 pixels * 256 * 256 to 16.16
+			d[i] = ((int64_t)top * 256 + (int64_t)(bottom - top) * fy) >> 6;
+		}
+		x += d[0];
+		y += d[1];
+	}
+};
+
+#endif
@@ -1,5 +1,24 @@
 #include "vector.h"
 
+uint32_t isqrt64(uint64_t v)
+{
+	uint64_t res = 0, bit = (uint64_t)1 << 62;
+
+	while (bit > v)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (v >= res + bit) {
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+	return res;
+}
+
 // intersect two segments, one defined by the 2 points (x1,y1) -> (x2,y2) and
 // another defined by (x3,y3) -> (x4,y4) and return the intersection in (res_x,res_y)
 static bool intersect_segment(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4, float *res_x, float *res_y)
@@ -16,6 +35,7 @@ static bool intersect_segment(float x1, float y1, float x2, float y2, float x3,
 	return true;
 }
 
+template <>
 bool intersect_lines(line2d_t &l1, line2d_t &l2, pt2d_t &result)
 {
 	return intersect_segment(
@@ -25,6 +45,28 @@ bool intersect_lines(line2d_t &l1, line2d_t &l2, pt2d_t &result)
 	);
 }
 
+// fixed point version: the line vectors are normalized, so the cross product
+// of the vectors is the sine of the angle between the lines
+template <>
+bool intersect_lines(line2d_base_t<fix16_t> &l1, line2d_base_t<fix16_t> &l2, pt2d_base_t<fix16_t> &result)
+{
+	int64_t divider, t;
+
+	divider = l1.v.cross(l2.v).raw;
+	if (divider > -66 && divider < 66)
+		return false;
+
+	// t = ((c2 - c1) x v2) / divider, in 16.16. Reject intersections that
+	// would overflow the fixed point range
+	t = (int64_t)(l2.c - l1.c).cross(l2.v).raw * 65536 / divider;
+	if (t > 0x3FFFFFFF || t < -0x3FFFFFFF)
+		return false;
+
+	result = l1.c + l1.v * fix16_t::from_raw(t);
+	return true;
+}
+
+template <>
 bool line_fit_t::compute(line2d_t &line)
 {
 	float tx, ty, x0, x1, theta;
@@ -32,14 +74,14 @@ bool line_fit_t::compute(line2d_t &line)
 	if (size < 2)
 		return false;
 
-	line.c.x = x / size;
-	line.c.y = y / size;
+	line.c.x = x / weight;
+	line.c.y = y / weight;
 
 	x0 = xx - x * line.c.x;
 	x1 = yy - y * line.c.y;
 
 	tx = x0 - x1;
-	ty = 2.0f * (xy - x * y / size);
+	ty = 2.0f * (xy - x * y / weight);
 
 	theta = 0.5f * atan2f(ty, tx);
 
@@ -48,3 +90,139 @@ bool line_fit_t::compute(line2d_t &line)
 
 	return true;
 }
+
+// (a * b) >> 16 without overflowing 64 bits, for "a" below 2^47 and a result
+// below 2^63 in absolute value. The low 16 bits of b are multiplied apart,
+// which gives the same result as the full product
+static int64_t mul_shift16(int64_t a, int64_t b)
+{
+	return a * (b >> 16) + ((a * (b & 0xFFFF)) >> 16);
+}
+
+// centered second order sum ab - a * b / weight of the 16.16 sums of a line
+// fit. a / weight is computed with 32 fractional bits, as rounding it to 16
+// would add an error of up to the coordinates / 65536 per point, which is
+// larger than the residual of long sides far from the origin
+static int64_t centered_sum(int64_t ab, int64_t a, int64_t b, int64_t weight)
+{
+	int64_t c, f;
+
+	c = a * 65536 / weight;
+	f = (a * 65536 - c * weight) * 65536 / weight;
+	return ab - mul_shift16(c, b) - (mul_shift16(f, b) >> 16);
+}
+
+// fixed point version: instead of computing the angle of the line, use the
+// eigenvector of the largest eigenvalue of the 2x2 scatter matrix directly,
+// which only needs integer square roots
+template <>
+bool line_fit_base_t<fix16_t>::compute(line2d_base_t<fix16_t> &line)
+{
+	int64_t cx, cy, sxx, syy, sxy, d, e, r, vx, vy, len;
+
+	if (size < 2)
+		return false;
+
+	// the sums are 16.16 in 64 bits. With coordinates below 16384 (2^30 in
+	// 16.16) and up to 65536 points of weight at most 1, x and y stay below
+	// 2^46 and xx, xy and yy below 2^60, so x * 65536 fits and the products
+	// with the center are computed with mul_shift16()
+	if (weight <= 0)
+		return false;
+	cx = x * 65536 / weight;
+	cy = y * 65536 / weight;
+	line.c.x = fix16_t::from_raw(cx);
+	line.c.y = fix16_t::from_raw(cy);
+
+	sxx = centered_sum(xx, x, x, weight);
+	syy = centered_sum(yy, y, y, weight);
+	sxy = centered_sum(xy, x, y, weight);
+
+	// scale the matrix terms down so that their squares fit in 64 bits.
+	// This doesn't change the direction of the eigenvector
+	d = sxx - syy;
+	e = 2 * sxy;
+	while (d > 0x1FFFFFFF || d < -0x1FFFFFFF || e > 0x1FFFFFFF || e < -0x1FFFFFFF) {
+		d >>= 1;
+		e >>= 1;
+	}
+	r = isqrt64(d * d + e * e);
+
+	// there are two equivalent expressions for the eigenvector, use the
+	// one that doesn't suffer from cancellation
+	if (d >= 0) {
+		vx = d + r;
+		vy = e;
+	} else {
+		vx = e;
+		vy = r - d;
+		if (vx < 0) {
+			vx = -vx;
+			vy = -vy;
+		}
+	}
+
+	len = isqrt64(vx * vx + vy * vy);
+	if (len == 0) {
+		line.v.x = fix16_t(1);
+		line.v.y = fix16_t(0);
+		return true;
+	}
+	line.v.x = fix16_t::from_raw(vx * 65536 / len);
+	line.v.y = fix16_t::from_raw(vy * 65536 / len);
+
+	return true;
+}
+
+// the squared distance of a point to the line is ((p - c) . n)^2, with the
+// normal n = (-v.y, v.x), which expands to a combination of the centered
+// second order sums
+template <>
+float line_fit_t::residual(const line2d_t &line)
+{
+	float sxx, syy, sxy, res;
+
+	if (weight <= 0)
+		return 0;
+
+	sxx = xx - x * line.c.x;
+	syy = yy - y * line.c.y;
+	sxy = xy - x * line.c.y;
+
+	// the sums far from the origin cancel, which can make it negative
+	res = (line.v.y * line.v.y * sxx - 2.0f * line.v.x * line.v.y * sxy +
+	       line.v.x * line.v.x * syy) / weight;
+	return res > 0 ? res : 0;
+}
+
+template <>
+fix16_t line_fit_base_t<fix16_t>::residual(const line2d_base_t<fix16_t> &line)
+{
+	int64_t sxx, syy, sxy, nx, ny, wx, wy, sum, mean;
+
+	if (weight <= 0)
+		return fix16_t(0);
+
+	// with the same bounds as compute(), the centered sums are below 2^60
+	sxx = centered_sum(xx, x, x, weight);
+	syy = centered_sum(yy, y, y, weight);
+	sxy = centered_sum(xy, x, y, weight);
+
+	// n^T S n, multiplying by the normal one component at a time. The
+	// products of the components (like nx * nx) are not rounded to 16.16,
+	// as their rounding error would be multiplied by the variance along
+	// the line, which is large for long sides
+	nx = -line.v.y.raw;
+	ny = line.v.x.raw;
+	wx = mul_shift16(nx, sxx) + mul_shift16(ny, sxy);
+	wy = mul_shift16(nx, sxy) + mul_shift16(ny, syy);
+	sum = mul_shift16(nx, wx) + mul_shift16(ny, wy);
+	if (sum < 0)
+		sum = 0;
+
+	// sum * 65536 / weight, saturated to the 16.16 range
+	mean = sum / weight;
+	if (mean >= 0x8000)
+		return fix16_t::from_raw(0x7FFFFFFF);
+	return fix16_t::from_raw(mean * 65536 + sum % weight * 65536 / weight);
+}
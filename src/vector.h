@@ -2,87 +2,244 @@
 #define VECTOR_H
 
 #include <math.h>
+#include <stdint.h>
 
-// include file with some basic geometry classes
+// include file with some basic geometry classes. The classes are templates on
+// the scalar type, so that they can use "float" or the "fix16_t" fixed point
+// type below on targets without a floating point unit
 
-class pt2d_t {
+// signed 16.16 fixed point number
+class fix16_t {
 public:
-	float x, y;
+	int32_t raw;
 
-	pt2d_t() {}
-	pt2d_t(float x, float y) : x(x), y(y) {}
+	fix16_t() {}
+	constexpr fix16_t(int v) : raw(v * 65536) {}
+	constexpr fix16_t(float v) : raw((int32_t)(v * 65536.0f)) {}
+	constexpr fix16_t(double v) : raw((int32_t)(v * 65536.0)) {}
 
-	pt2d_t operator+(const pt2d_t &rhs) {
-		return pt2d_t(x + rhs.x, y + rhs.y);
+	static constexpr fix16_t from_raw(int32_t r) {
+		return fix16_t(r, true);
 	}
-	void operator+=(const pt2d_t &rhs) {
+
+	explicit operator float() const {
+		return raw * (1.0f / 65536);
+	}
+	// rounds towards minus infinity
+	explicit operator int() const {
+		return raw >> 16;
+	}
+
+	fix16_t operator+(const fix16_t &rhs) const {
+		return from_raw(raw + rhs.raw);
+	}
+	fix16_t operator-(const fix16_t &rhs) const {
+		return from_raw(raw - rhs.raw);
+	}
+	fix16_t operator-(void) const {
+		return from_raw(-raw);
+	}
+	fix16_t operator*(const fix16_t &rhs) const {
+		return from_raw(((int64_t)raw * rhs.raw) >> 16);
+	}
+	fix16_t operator/(const fix16_t &rhs) const {
+		return from_raw(((int64_t)raw * 65536) / rhs.raw);
+	}
+	void operator+=(const fix16_t &rhs) {
+		raw += rhs.raw;
+	}
+	void operator-=(const fix16_t &rhs) {
+		raw -= rhs.raw;
+	}
+	void operator*=(const fix16_t &rhs) {
+		*this = *this * rhs;
+	}
+
+	bool operator<(const fix16_t &rhs) const { return raw < rhs.raw; }
+	bool operator>(const fix16_t &rhs) const { return raw > rhs.raw; }
+	bool operator<=(const fix16_t &rhs) const { return raw <= rhs.raw; }
+	bool operator>=(const fix16_t &rhs) const { return raw >= rhs.raw; }
+	bool operator==(const fix16_t &rhs) const { return raw == rhs.raw; }
+	bool operator!=(const fix16_t &rhs) const { return raw != rhs.raw; }
+
+private:
+	constexpr fix16_t(int32_t r, bool) : raw(r) {}
+};
+
+// integer square root of a 64 bit number
+uint32_t isqrt64(uint64_t v);
+
+// numeric policy: the operations the geometry classes need from each scalar
+// type that are not plain arithmetic
+template <class T> struct geom_traits;
+
+template <> struct geom_traits<float> {
+	// type used to accumulate sums of products in line_fit_base_t
+	typedef float accum_t;
+
+	static float sqrt(float v) { return sqrtf(v); }
+	static float abs(float v) { return fabsf(v); }
+	static accum_t accum(float v) { return v; }
+	static accum_t accum_mul(float a, float b) { return a * b; }
+	static float accum_div(accum_t num, accum_t den) { return num / den; }
+
+	// conversion to / from a 16.16 fixed point integer
+	static int32_t to_raw16(float v) { return v * 65536.0f; }
+	static float from_raw16(int32_t v) { return v * (1.0f / 65536); }
+};
+
+template <> struct geom_traits<fix16_t> {
+	// sums of products are accumulated as 16.16 in 64 bits, so that they
+	// don't overflow
+	typedef int64_t accum_t;
+
+	static fix16_t sqrt(fix16_t v) {
+		return fix16_t::from_raw(v.raw <= 0 ? 0 : isqrt64((uint64_t)v.raw << 16));
+	}
+	static fix16_t abs(fix16_t v) { return v.raw < 0 ? -v : v; }
+	static accum_t accum(fix16_t v) { return v.raw; }
+	static accum_t accum_mul(fix16_t a, fix16_t b) { return ((int64_t)a.raw * b.raw) >> 16; }
+	static fix16_t accum_div(accum_t num, accum_t den) { return fix16_t::from_raw(num * 65536 / den); }
+
+	static int32_t to_raw16(fix16_t v) { return v.raw; }
+	static fix16_t from_raw16(int32_t v) { return fix16_t::from_raw(v); }
+};
+
+template <class T>
+class pt2d_base_t {
+public:
+	T x, y;
+
+	pt2d_base_t() {}
+	pt2d_base_t(T x, T y) : x(x), y(y) {}
+
+	// conversion between points with different scalar types
+	template <class U>
+	explicit pt2d_base_t(const pt2d_base_t<U> &p) : x(T(p.x)), y(T(p.y)) {}
+
+	pt2d_base_t operator+(const pt2d_base_t &rhs) const {
+		return pt2d_base_t(x + rhs.x, y + rhs.y);
+	}
+	void operator+=(const pt2d_base_t &rhs) {
 		*this = *this + rhs;
 	}
-	pt2d_t operator-(const pt2d_t &rhs) {
-		return pt2d_t(x - rhs.x, y - rhs.y);
+	pt2d_base_t operator-(const pt2d_base_t &rhs) const {
+		return pt2d_base_t(x - rhs.x, y - rhs.y);
 	}
-	pt2d_t operator-(void) {
-		return pt2d_t(-x, -y);
+	pt2d_base_t operator-(void) const {
+		return pt2d_base_t(-x, -y);
 	}
-	pt2d_t operator*(float scaler) {
-		return pt2d_t(x * scaler, y * scaler);
+	pt2d_base_t operator*(T scaler) const {
+		return pt2d_base_t(x * scaler, y * scaler);
 	}
-	void operator*=(float scaler) {
+	void operator*=(T scaler) {
 		*this = *this * scaler;
 	}
-	float norm(void) {
-		return sqrt(x * x + y * y);
+	T norm2(void) const {
+		return x * x + y * y;
+	}
+	T norm(void) const {
+		return geom_traits<T>::sqrt(x * x + y * y);
 	}
-	float cross(const pt2d_t &rhs) {
+	T cross(const pt2d_base_t &rhs) const {
 		return x * rhs.y - y * rhs.x;
 	}
 	void normalize(void) {
-		float n = norm();
-		if (n < 1e-6)
+		T n = norm();
+		if (n < T(1e-6f) || n == T(0))
 			return;
-		x /= n;
-		y /= n;
+		x = x / n;
+		y = y / n;
 	}
 };
 
-class line2d_t {
+template <class T>
+class line2d_base_t {
 public:
 	// line is defined by a center point "c" and a vector "v"
-	pt2d_t c, v;
+	pt2d_base_t<T> c, v;
 };
 
-class line_fit_t {
+template <class T>
+class line_fit_base_t {
 protected:
-	float x, y, xx, xy, yy;
+	typedef typename geom_traits<T>::accum_t accum_t;
+
+	accum_t x, y, xx, xy, yy, weight;
 	int size;
 
 public:
-	line_fit_t() {
+	line_fit_base_t() {
 		reset();
 	}
 
 	void reset(void) {
 		size = 0;
-		x = 0.0f;
-		y = 0.0f;
-		xx = 0.0f;
-		xy = 0.0f;
-		yy = 0.0f;
-	}
-
-	void add(float px, float py) {
-		x += px;
-		y += py;
-		xx += px * px;
-		xy += px * py;
-		yy += py * py;
+		x = 0;
+		y = 0;
+		xx = 0;
+		xy = 0;
+		yy = 0;
+		weight = 0;
+	}
+
+	void add(T px, T py) {
+		x += geom_traits<T>::accum(px);
+		y += geom_traits<T>::accum(py);
+		xx += geom_traits<T>::accum_mul(px, px);
+		xy += geom_traits<T>::accum_mul(px, py);
+		yy += geom_traits<T>::accum_mul(py, py);
+		weight += geom_traits<T>::accum(T(1));
 		size++;
 	}
 
-	bool compute(line2d_t &line);
+	// add a point with weight "w" (between 0 and 1)
+	void add(T px, T py, T w) {
+		T wx = px * w, wy = py * w;
+
+		x += geom_traits<T>::accum(wx);
+		y += geom_traits<T>::accum(wy);
+		xx += geom_traits<T>::accum_mul(wx, px);
+		xy += geom_traits<T>::accum_mul(wx, py);
+		yy += geom_traits<T>::accum_mul(wy, py);
+		weight += geom_traits<T>::accum(w);
+		size++;
+	}
+
+	bool compute(line2d_base_t<T> &line);
+
+	// mean squared distance of the points to "line", which must be the
+	// line returned by compute()
+	T residual(const line2d_base_t<T> &line);
 };
 
+// weight of a point at distance "dist" from a line for robust fitting, using
+// the Huber function: points closer than "delta" have weight 1, points further
+// away have their influence capped
+template <class T>
+T huber_weight(T dist, T delta)
+{
+	dist = geom_traits<T>::abs(dist);
+	if (dist <= delta)
+		return T(1);
+	return delta / dist;
+}
+
 // returns true if the lines intersect
-bool intersect_lines(line2d_t &l1, line2d_t &l2, pt2d_t &result);
+template <class T>
+bool intersect_lines(line2d_base_t<T> &l1, line2d_base_t<T> &l2, pt2d_base_t<T> &result);
+
+// the fit and intersection are implemented for each scalar type in vector.cc
+template <> bool line_fit_base_t<float>::compute(line2d_base_t<float> &line);
+template <> bool line_fit_base_t<fix16_t>::compute(line2d_base_t<fix16_t> &line);
+template <> float line_fit_base_t<float>::residual(const line2d_base_t<float> &line);
+template <> fix16_t line_fit_base_t<fix16_t>::residual(const line2d_base_t<fix16_t> &line);
+template <> bool intersect_lines(line2d_base_t<float> &l1, line2d_base_t<float> &l2, pt2d_base_t<float> &result);
+template <> bool intersect_lines(line2d_base_t<fix16_t> &l1, line2d_base_t<fix16_t> &l2, pt2d_base_t<fix16_t> &result);
+
+// the float versions keep their original names
+typedef pt2d_base_t<float> pt2d_t;
+typedef line2d_base_t<float> line2d_t;
+typedef line_fit_base_t<float> line_fit_t;
 
 #endif
@@ -0,0 +1,84 @@
+// write the database selected with ARUCO_DB (and optionally restricted with
+// ARUCO_DB_SIZE) to a binary dictionary file, that can be loaded at run time
+// with aruco_dictionary_t::load() or aruco_dictionary_file_t. The tables are
+// the ones generated when compiling ArucoLite, so the lookup indexes are
+// already built in the file. Build it once per database, for example:
+//
+//   g++ -std=gnu++14 -I../src -DARUCO_DB=ARUCO_DB_APRILTAG_36h11 dictionary_converter.cc -o dictionary_converter
+//   ./dictionary_converter apriltag_36h11.bin
+//
+// Define ARUCO_COMPACT_DICTIONARY to 1 to write only the canonical rotations
+
+#include <stdio.h>
+#include "database.h"
+#include "dictionary.h"
+
+#ifndef ARUCO_COMPACT_DICTIONARY
+#define ARUCO_COMPACT_DICTIONARY	0
+#endif
+
+typedef aruco_dictionary_tables_t<ARUCO_DB_SIZE, ARUCO_BITS, database_codes,
+				  ARUCO_COMPACT_DICTIONARY ? 1 : 4> tables;
+
+// the file is little endian on any host
+static void put(FILE *f, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		fputc((v >> (i * 8)) & 0xFF, f);
+}
+
+static void pad(FILE *f, long offset)
+{
+	while (ftell(f) < offset)
+		fputc(0, f);
+}
+
+int main(int argc, char **argv)
+{
+	const aruco_dictionary_t &dict = tables::dictionary;
+	const long header_size = sizeof(aruco_dictionary_header_t);
+	const long rotations_offset = (header_size + 7) & ~7;
+	const int stored = dict.stored_rotations;
+	const long rotations_size = dict.size * stored * dict.code_bytes;
+	const long table_offset = (rotations_offset + rotations_size + 7) & ~7;
+	const long file_size = table_offset + (2 << dict.table_shift);
+	FILE *f;
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <output file>\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[1], "wb");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	put(f, ARUCO_DICTIONARY_MAGIC, 4);
+	put(f, ARUCO_DICTIONARY_VERSION, 2);
+	put(f, dict.bits, 1);
+	put(f, dict.code_bytes, 1);
+	put(f, dict.size, 4);
+	put(f, dict.table_shift, 4);
+	put(f, rotations_offset, 4);
+	put(f, table_offset, 4);
+	put(f, file_size, 4);
+	put(f, stored, 4);
+
+	pad(f, rotations_offset);
+	for (i = 0; i < dict.size * stored; i++)
+		put(f, dict.code(i / stored, i % stored), dict.code_bytes);
+
+	pad(f, table_offset);
+	for (i = 0; i < (1 << dict.table_shift); i++)
+		put(f, dict.table[i], 2);
+
+	if (fclose(f) != 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	printf("%s: %d arucos of %dx%d bits, %ld bytes\n", argv[1], dict.size, dict.bits, dict.bits, file_size);
+	return 0;
+}